@@ -14,6 +14,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <getopt.h>
 
 
 #define MAX_REQUEST_BODY_LENGTH 4096
@@ -23,6 +28,9 @@
 #define HTTP_MINOR_VERSION 0
 #define SERVER_NAME "httpd"
 #define SERVER_VERSION "1.0"
+#define USAGE "Usage: %s [--fd=n] <docroot>\n"
+#define SD_LISTEN_FDS_START 3   // systemdが渡すソケットの最初のfd
+#define ACCEPT_RETRY_DELAY_USEC 10000
 
 static void log_exit(char *fmt, ...) {
     va_list ap;
@@ -60,6 +68,17 @@ static void install_signal_handlers(void) {
     trap_signal(SIGPIPE, signal_exit);
 }
 
+// 接続ごとの子プロセスをwait(2)しなくてもゾンビにならないようにする
+static void detach_children(void) {
+    struct sigaction act;
+
+    act.sa_handler = SIG_IGN;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
+    if (sigaction(SIGCHLD, &act, NULL) < 0)
+        log_exit("sigaction(2) failed: %s", strerror(errno));
+}
+
 struct HTTPHeaderField {
     char *name;
     char *value;
@@ -347,6 +366,42 @@ static void not_found(struct HTTPRequest *req, FILE *out) {
     fflush(out);
 }
 
+// TCP_CORKを付けている間は中途半端なサイズのセグメントを送らずに溜めておいてくれる
+// inetd経由ならoutはソケット、そうでなければ単に失敗するだけ
+static void set_tcp_cork(int fd, int on) {
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// ファイルの中身をout_fdへ送る
+// sendfile(2)はページキャッシュから直接コピーするので、ユーザー空間のバッファを経由しなくて済む
+static void send_file_body(int out_fd, int fd, char *path, long size) {
+    char buf[BLOCK_BUF_SIZE];
+    off_t offset = 0;
+    ssize_t n;
+
+    while (offset < size) {
+        n = sendfile(out_fd, fd, &offset, size - offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // sendfile(2)が使えない組み合わせのときだけ従来のコピーに切り替える
+            if (errno == EINVAL || errno == ENOSYS) break;
+            log_exit("failed to send %s: %s", path, strerror(errno));
+        }
+        if (n == 0)
+            log_exit("failed to send %s: file truncated", path);
+    }
+    while (offset < size) {
+        n = pread(fd, buf, BLOCK_BUF_SIZE, offset);
+        if (n < 0)
+            log_exit("failed to read %s: %s", path, strerror(errno));
+        if (n == 0)
+            break;
+        if (write(out_fd, buf, n) < n)
+            log_exit("failed to write to socket: %s", strerror(errno));
+        offset += n;
+    }
+}
+
 static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot) {
     struct FileInfo *info;
 
@@ -363,25 +418,16 @@ static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
     // if GET or POST or etc...
     if (strcmp(req->method, "HEAD") != 0) {
         int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
 
         fd = open(info->path, O_RDONLY);
 
         if (fd < 0)
             log_exit("failed to open %s: %s", info->path, strerror(errno));
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0)
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            
-            // 最後まで読んだ場合
-            if (n == 0)
-                break;
-            // 呼んだ分だけソケットに対して書き込み
-            if (fwrite(buf, 1, n, out) < n)
-                log_exit("failed to write to socket: %s", strerror(errno));
-        } 
+        // stdioのバッファに溜まっているヘッダを先に出してから、ボディはfdへ直接送る
+        set_tcp_cork(fileno(out), 1);
+        fflush(out);
+        send_file_body(fileno(out), fd, info->path, info->size);
+        set_tcp_cork(fileno(out), 0);
         close(fd);
     }
 
@@ -408,6 +454,95 @@ static void service(FILE *in, FILE *out, char *docroot) {
     free_request(req);
 }
 
+/*
+ * ソケットアクティベーション
+ *
+ * inetdのnowaitのように接続ごとにexecされると、プロセスの起動に毎回コストがかかる。
+ * listenしているソケットを受け取れば、自分でaccept(2)して接続を処理できる。
+ * 受け取り方は2通り:
+ *   systemdのソケットアクティベーション: LISTEN_PIDが自分のpidならLISTEN_FDS個のソケットがfd 3から渡される (扱えるのは1つだけ)
+ *   --fd=n: 起動する側があらかじめ開いておいたfdを指定する
+ * どちらも無ければ従来どおりstdin/stdoutで1リクエストだけ処理する (inetd経由)。
+ */
+
+// systemdから渡されたソケットを返す、無ければ-1
+static int sd_listen_fd(void) {
+    char *pid, *fds;
+    int n;
+
+    pid = getenv("LISTEN_PID");
+    fds = getenv("LISTEN_FDS");
+    if (!pid || !fds) return -1;
+    // 親から環境変数だけ引き継いだ別のプロセスに向けたものかもしれない
+    if (atol(pid) != (long)getpid()) return -1;
+    // 接続を処理する子プロセスには関係ないので消しておく
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    n = atoi(fds);
+    if (n < 1) return -1;
+    // accept(2)するのは1つだけなので、残りのアドレスへの接続が黙って放置されないよう起動を止める
+    if (n > 1)
+        log_exit("LISTEN_FDS=%d: only one socket is supported, use one ListenStream= per socket unit", n);
+    return SD_LISTEN_FDS_START;
+}
+
+// 受け取ったfdがlistenしているソケットであることを確かめる
+static void check_listen_socket(int fd) {
+    int val;
+    socklen_t len = sizeof val;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) < 0)
+        log_exit("fd %d is not a socket: %s", fd, strerror(errno));
+    if (!val)
+        log_exit("fd %d is not a listening socket", fd);
+    // 接続を処理する子プロセスがexecすることは無いが、念のため引き継がないようにする
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+// fdやメモリが足りないだけなら、接続が終わって空けば回復するので少し待って続ける
+static int accept_error_is_transient(int err) {
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM) return 0;
+    fprintf(stderr, "accept(2) failed: %s\n", strerror(err));
+    usleep(ACCEPT_RETRY_DELAY_USEC);
+    return 1;
+}
+
+// accept(2)したらforkし、子プロセスが接続をstdin/stdoutの代わりにしてservice()する
+// リクエストの処理中のエラーはlog_exit()でプロセスごと終わらせているので、
+// 接続ごとに子プロセスに分けておけば1つの接続のエラーで全体が止まることはない
+static void server_main(int server_fd, char *docroot) {
+    for (;;) {
+        int sock;
+        pid_t pid;
+
+        sock = accept(server_fd, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (accept_error_is_transient(errno)) continue;
+            log_exit("accept(2) failed: %s", strerror(errno));
+        }
+        pid = fork();
+        if (pid < 0) {
+            // この接続だけ諦めて次を待つ
+            fprintf(stderr, "fork(2) failed: %s\n", strerror(errno));
+            close(sock);
+            continue;
+        }
+        if (pid == 0) {
+            FILE *inf, *outf;
+
+            close(server_fd);
+            inf = fdopen(sock, "r");
+            outf = fdopen(sock, "w");
+            if (!inf || !outf) log_exit("fdopen(3) failed: %s", strerror(errno));
+            service(inf, outf, docroot);
+            exit(0);
+        }
+        close(sock);
+    }
+}
+
 void debug() {
     struct HTTPRequest *req;
     FILE *file;
@@ -430,17 +565,51 @@ void debug() {
     }
 }
 
+static struct option longopts[] = {
+    {"fd", required_argument, NULL, 'f'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
 int main(int argc, char *argv[]) {
+    int server_fd = -1;
+    int opt;
+
     // debug();
     // exit(0);
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <docroot>\n", argv[0]);
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            server_fd = atoi(optarg);
+            if (server_fd < 0) {
+                fprintf(stderr, "invalid --fd value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'h':
+            fprintf(stdout, USAGE, argv[0]);
+            exit(0);
+        case '?':
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, USAGE, argv[0]);
         exit(1);
     }
 
     install_signal_handlers();
-    service(stdin, stdout, argv[1]);
+    if (server_fd < 0) server_fd = sd_listen_fd();
+    if (server_fd < 0) {
+        // inetd経由: 接続はstdin/stdoutにつながっている
+        service(stdin, stdout, argv[optind]);
+        exit(0);
+    }
+    check_listen_socket(server_fd);
+    detach_children();
+    server_main(server_fd, argv[optind]);
     exit(0);
 }
 
@@ -9,47 +9,125 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <getopt.h>
 #include <syslog.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <netdb.h>
 #include <grp.h>
 #include <pwd.h>
+#ifdef USE_ZLIB
+// gcc -DUSE_ZLIB ... -lz でビルドすると--gzipでその場での圧縮が使える
+#include <zlib.h>
+#endif
 
-#define MAX_REQUEST_BODY_LENGTH 4096
-#define LINE_BUF_SIZE 255
 #define BLOCK_BUF_SIZE 4096
-#define TIME_BUF_SIZE 4096
-#define HTTP_MINOR_VERSION 0
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+#define HTTP_MINOR_VERSION 1
 #define SERVER_NAME "httpd2"
 #define SERVER_VERSION "1.0"
 
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] <docroot>\n"
-#define MAX_BACKLOG 1
+#define USAGE "Usage: %s [--port=n] [--listen=addr ...] [--backlog=n] [--prefork=n | --threads=n] [--event]" \
+    " [--keepalive-timeout=sec] [--max-keepalive-requests=n] [--file-cache=n] [--file-cache-ttl=sec]" \
+    " [--response-cache=bytes] [--response-cache-max-object=bytes] [--precompressed] [--gzip] [--mime-types=file]" \
+    " [--status-path=path] [--access-log=file] [--max-request-body=bytes] [--header-timeout=sec] [--body-timeout=sec] [--send-timeout=sec] [--max-connections=n]" \
+    " [--chroot --user=u --group=g] <docroot>\n"
+#define DEFAULT_BACKLOG 128
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 30
+#define DEFAULT_SEND_TIMEOUT 30
+#define DEFAULT_MAX_CONNECTIONS 1024
+#define DEFAULT_MAX_KEEPALIVE_REQUESTS 100
+#define DEFAULT_FILE_CACHE_ENTRIES 1024
+#define DEFAULT_FILE_CACHE_TTL 1
+#define FILE_CACHE_FD_RESERVE 32    // ログやepollなど、接続とlistening socket以外に使うfd
+#define FILE_CACHE_EVICT_ON_EMFILE 32
+#define DEFAULT_RESPONSE_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_RESPONSE_CACHE_MAX_OBJECT (64 * 1024)
+#define DEFAULT_MAX_REQUEST_BODY (1024 * 1024)
+#define WORKER_RESPAWN_INTERVAL 1
+#define MAX_EVENTS 64
+#define ACCEPT_RETRY_DELAY_USEC 10000
+#define LINGERING_TIMEOUT 2
+#define UPGRADE_LISTEN_FDS_ENV "HTTPD2_LISTEN_FDS"  // 引き継ぐlistening socketのfd (カンマ区切り)
+#define UPGRADE_READY_FD_ENV "HTTPD2_UPGRADE_FD"    // 起動できたら1バイト書いて知らせるパイプ
+#define UPGRADE_TIMEOUT 10
+#define DRAIN_SIGNAL_INTERVAL 1
+#define MAX_LISTEN_ADDRS 16
+#define UNIX_SOCKET_PREFIX "unix:"
 
 static int debug_mode = 0;
+static int prefork_workers = 0;
+static int event_mode = 0;
+static int thread_workers = 0;
+static int listen_backlog = DEFAULT_BACKLOG;
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+static int header_timeout = DEFAULT_HEADER_TIMEOUT;    // ヘッダが届き始めてから届き終えるまで
+static int body_timeout = DEFAULT_BODY_TIMEOUT;        // ボディの受信が進まない時間
+static int send_timeout = DEFAULT_SEND_TIMEOUT;        // レスポンスの送信が進まない時間
+static int max_connections = DEFAULT_MAX_CONNECTIONS;  // fork(2)モデルでは全体、イベントループではループごと
+static int max_keepalive_requests = DEFAULT_MAX_KEEPALIVE_REQUESTS;
+static int file_cache_entries = DEFAULT_FILE_CACHE_ENTRIES;
+static int file_cache_ttl = DEFAULT_FILE_CACHE_TTL;
+static size_t response_cache_size = DEFAULT_RESPONSE_CACHE_SIZE;
+static long response_cache_max_object = DEFAULT_RESPONSE_CACHE_MAX_OBJECT;
+static long max_request_body = DEFAULT_MAX_REQUEST_BODY;
+static char *status_path = NULL;   // 統計を返すURLのパス、NULLなら返さない
+static char *access_log_path = NULL;    // NULLならアクセスログを書かない
+static int precompressed = 0;
+static int gzip_on_the_fly = 0;
 
 static void stop(const char *message) {
     printf("# %s\n", message);
     getchar();
 }
 
-static void log_exit(const char *fmt, ...) {
-    va_list ap;
-
-    va_start(ap, fmt);
+static void log_vprintf(int priority, const char *fmt, va_list ap) {
     if (debug_mode) {
         vfprintf(stderr, fmt, ap);
         fputc('\n', stderr);
     } else {
-        vsyslog(LOG_ERR, fmt, ap);
+        vsyslog(priority, fmt, ap);
     }
+}
+
+// プロセスを終了させずにログだけ出す
+static void log_message(int priority, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vprintf(priority, fmt, ap);
+    va_end(ap);
+}
+
+static void log_exit(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vprintf(LOG_ERR, fmt, ap);
     va_end(ap);
     exit(1);
 }
@@ -72,21 +150,38 @@ static void trap_signal(int sig, sighandler_t handler) {
         log_exit("sigaction(2) failed: %s", strerror(errno));
 }
 
-static void signal_exit(int sig) {
-    log_exit("exit by signal %d", sig);
-}
-
 static void noop_handler(int sig) {
     ;
 }
 
-// 子プロセスがゾンビになるのを防止する、wait()を呼ばないと宣言する
-static void detach_children(void) {
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t draining = 0;
+
+// SIGUSR1でキャッシュの統計をログに出す、実際に出すのは処理の合間 (check_stats_request())
+static void request_stats(int sig) {
+    stats_requested = 1;
+}
+
+// SIGHUP: 設定の再読み込み、SIGUSR2: 新しいバイナリへの入れ替え、SIGQUIT: 処理中の接続を終えてから終了
+// 実際の処理はcheck_control_requests()などで行う
+static void request_control(int sig) {
+    switch (sig) {
+    case SIGHUP:  reload_requested = 1; break;
+    case SIGUSR2: upgrade_requested = 1; break;
+    case SIGQUIT: draining = 1; break;
+    }
+}
+
+// fork(2)モデルでは同時接続数を数えるために子プロセスを自分でwait(2)する (reap_children())
+// 子プロセスが終わったらaccept(2)から抜けてすぐに回収できるよう、SA_RESTARTは付けない
+static void watch_children(void) {
     struct sigaction act;
 
     act.sa_handler = noop_handler;
     sigemptyset(&act.sa_mask);
-    act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
+    act.sa_flags = SA_NOCLDSTOP;
     if (sigaction(SIGCHLD, &act, NULL) < 0) {
         log_exit("sigaction(2) failed: %s", strerror(errno));
     }
@@ -94,535 +189,4487 @@ static void detach_children(void) {
 
 
 static void install_signal_handlers(void) {
-    trap_signal(SIGPIPE, signal_exit);
-    detach_children();
+    struct sigaction act;
+
+    // 相手が切断した接続への書き込みでプロセスごと落ちないようSIGPIPEは無視し、EPIPEで扱う
+    // sendfile(2)にはMSG_NOSIGNALに当たるフラグが無いのでシグナル自体を無視する必要がある
+    signal(SIGPIPE, SIG_IGN);
+    // プリフォークモデルではマスターが wait(2) でワーカーの終了を検知する
+    // スレッドモードとイベントループだけの場合は子プロセスを作らない
+    if (prefork_workers == 0 && thread_workers == 0 && !event_mode)
+        watch_children();
+    trap_signal(SIGUSR1, request_stats);
+    // accept(2)やwait(2)で待っているところから抜けてすぐに処理できるよう、SA_RESTARTは付けない
+    // ブロッキングのソケットの読み書きは中断されても呼び直す (read_request()・send_response())
+    act.sa_handler = request_control;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGHUP, &act, NULL) < 0 || sigaction(SIGUSR2, &act, NULL) < 0 ||
+        sigaction(SIGQUIT, &act, NULL) < 0)
+        log_exit("sigaction(2) failed: %s", strerror(errno));
+}
+
+/*
+ * 統計
+ *
+ * ワーカー (プリフォークのプロセスかスレッド) ごとに1つスロットを持ち、自分のスロットにだけ書き込む。
+ * 書き込むのは実質そのワーカーだけなのでロックは取らず、読み手と食い違わないよう
+ * カウンタはアトミックに足す (接続ごとにforkするモデルでは子プロセスがスロット0を共有する)。
+ * スロットは起動時にMAP_SHAREDでmmap(2)しておくので、fork(2)したワーカーの分も
+ * どのプロセスからでも読める。読むときは全スロットを足し合わせる。
+ * スロットをキャッシュラインに揃え、ワーカー間で同じラインを書き合わないようにする。
+ */
+#define LATENCY_BUCKETS 24  // バケットiは2^i マイクロ秒未満、最後 (約8秒) を超えたものは溢れとして数える
+
+enum StatMethod {
+    STAT_GET,
+    STAT_HEAD,
+    STAT_POST,
+    STAT_OTHER_METHOD,
+    NUM_STAT_METHODS,
+};
+
+static const char *stat_method_names[NUM_STAT_METHODS] = { "GET", "HEAD", "POST", "other" };
+
+// 個別に数えるステータスコード、それ以外はまとめて数える
+static const int stat_status_codes[] = { 200, 206, 304, 400, 404, 405, 413, 416, 431, 500, 501 };
+#define NUM_STAT_STATUSES (sizeof(stat_status_codes) / sizeof(stat_status_codes[0]) + 1)
+
+enum LatencyKind {
+    LAT_PARSE,      // リクエストの解析
+    LAT_OPEN,       // ファイルを開く (キャッシュのヒットも含む)
+    LAT_SEND,       // レスポンスを組み立ててから送り終えるまで
+    NUM_LATENCIES,
+};
+
+static const char *latency_names[NUM_LATENCIES] = { "parse", "open", "send" };
+
+struct LatencyHistogram {
+    unsigned long buckets[LATENCY_BUCKETS + 1];
+    unsigned long count;
+    unsigned long sum_usec;
+};
+
+struct WorkerStats {
+    unsigned long requests[NUM_STAT_METHODS];
+    unsigned long responses[NUM_STAT_STATUSES];
+    unsigned long bytes_sent;
+    unsigned long connections;
+    long active_connections;
+    unsigned long file_cache_hits;
+    unsigned long file_cache_misses;
+    unsigned long response_cache_hits;
+    unsigned long response_cache_misses;
+    unsigned long response_cache_evictions;
+    // このワーカーがレスポンスキャッシュに入れたバイト数から捨てたバイト数を引いたもの
+    // スレッドでは共有のキャッシュ、プロセスでは各自のキャッシュの使用量が合計で求まる
+    long response_cache_bytes;
+    unsigned long access_log_dropped;   // リングバッファが一杯で捨てたアクセスログの行数
+    struct LatencyHistogram latency[NUM_LATENCIES];
+} __attribute__((aligned(64)));
+
+static struct WorkerStats *stats_slots;
+static int stats_nslots;
+static __thread struct WorkerStats *worker_stats;  // 自分のスロット
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&worker_stats->field, (n), __ATOMIC_RELAXED)
+
+static void stats_init(int nslots) {
+    stats_slots = mmap(NULL, sizeof(struct WorkerStats) * nslots, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats_slots == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    stats_nslots = nslots;
+    worker_stats = &stats_slots[0];
+}
+
+// ワーカーが自分のスロットを使い始める、起動し直したワーカーは前のワーカーの累計を引き継ぐ
+static void stats_attach(int slot) {
+    worker_stats = &stats_slots[slot];
+    // 落ちたワーカーの接続もキャッシュももう無い
+    __atomic_store_n(&worker_stats->active_connections, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker_stats->response_cache_bytes, 0, __ATOMIC_RELAXED);
+}
+
+// 単調増加の時計、マイクロ秒
+static long now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void stats_record_latency(enum LatencyKind kind, long usec) {
+    struct LatencyHistogram *h = &worker_stats->latency[kind];
+    int b;
+
+    if (usec < 0) usec = 0;
+    // 2進の桁数がそのままバケットの番号になる
+    b = usec == 0 ? 0 : 64 - __builtin_clzl(usec);
+    if (b > LATENCY_BUCKETS) b = LATENCY_BUCKETS;
+    __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_usec, usec, __ATOMIC_RELAXED);
+}
+
+/*
+ * リクエスト解析用のアリーナ (バンプアロケータ)
+ *
+ * リクエストの構造体やヘッダのリストはここから切り出し、
+ * リクエストを処理し終えたらarena_reset()でまとめて捨てる。個別のfree(3)は要らない。
+ * 接続ごとに1つ持ち、バッファは次のリクエストでも使い回す。
+ * 収まらなかった分は追加のチャンクをmalloc(3)するが、リセット時に次から収まる大きさへ広げるので
+ * 同じような大きさのリクエストが続く限りmalloc(3)/free(3)は呼ばれない。
+ */
+#define ARENA_INITIAL_SIZE 4096
+#define ARENA_ALIGN (sizeof(void *) * 2)
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    char data[];
+};
+
+struct Arena {
+    char *buf;
+    size_t cap;
+    size_t used;
+    struct ArenaChunk *chunks;  // bufに収まらなかったときに追加したチャンク
+    size_t overflow;            // 追加したチャンクの合計サイズ
+};
+
+static void arena_init(struct Arena *arena) {
+    arena->cap = ARENA_INITIAL_SIZE;
+    arena->buf = xmalloc(arena->cap);
+    arena->used = 0;
+    arena->chunks = NULL;
+    arena->overflow = 0;
+}
+
+static void *arena_alloc(struct Arena *arena, size_t sz) {
+    struct ArenaChunk *chunk;
+    void *p;
+
+    sz = (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (arena->used + sz <= arena->cap) {
+        p = arena->buf + arena->used;
+        arena->used += sz;
+        return p;
+    }
+    chunk = xmalloc(sizeof(struct ArenaChunk) + sz);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->overflow += sz;
+    return chunk->data;
+}
+
+static void arena_reset(struct Arena *arena) {
+    struct ArenaChunk *chunk;
+
+    while ((chunk = arena->chunks)) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    // 溢れた分を含めて1つのバッファに収まるように広げておく
+    if (arena->overflow > 0) {
+        free(arena->buf);
+        arena->cap += arena->overflow;
+        arena->buf = xmalloc(arena->cap);
+        arena->overflow = 0;
+    }
+    arena->used = 0;
 }
 
+static void arena_destroy(struct Arena *arena) {
+    arena_reset(arena);
+    free(arena->buf);
+    arena->buf = NULL;
+}
+
+/*
+ * リクエストの解析
+ *
+ * 受信バッファに溜めたバイト列をその場で解析する。メソッド・パス・ヘッダ名・ヘッダ値は
+ * 受信バッファの中を直接指すスライス (ポインタと長さ) で、文字列のコピーはしない。
+ * 区切り文字 (空白・':'・改行) は'\0'で上書きするので、スライスはそのままC文字列としても使える。
+ * 行の長さに上限はなく、ヘッダ全体がMAX_REQUEST_HEADER_SIZEに収まればよい。
+ * ヘッダの終わり (空行) が届くまでは解析を始めず、続きが届いたら前回探し終えた位置から探し直す。
+ */
+#define MAX_REQUEST_HEADER_SIZE 16384
+#define RECV_BUF_SIZE 4096
+#define MAX_CHUNK_LINE_SIZE 4096   // チャンクのサイズの行とトレーラーの1行
+// ボディは届いた分からハンドラに渡して捨てるので、ヘッダの後に要るのはチャンクの1行分だけ
+#define MAX_RECV_BUF_SIZE (MAX_REQUEST_HEADER_SIZE + MAX_CHUNK_LINE_SIZE)
+
+struct Slice {
+    char *ptr;  // ptr[len]は'\0'
+    size_t len;
+};
+
 struct HTTPHeaderField {
-    char *name;
-    char *value;
-    struct HTTPHeaderField *next;
+    struct Slice name;
+    struct Slice value;
+    size_t hash;    // 小文字にしたヘッダ名のハッシュ値
+};
+
+/*
+ * よく参照するヘッダは解析時に一度だけ名前を照合してスロットに入れておき、
+ * 参照するたびにヘッダを走査しなくて済むようにする
+ */
+enum KnownHeader {
+    HDR_CONTENT_LENGTH,
+    HDR_CONNECTION,
+    HDR_HOST,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_RANGE,
+    HDR_ACCEPT_ENCODING,
+    HDR_TRANSFER_ENCODING,
+    HDR_REFERER,
+    HDR_USER_AGENT,
+    NUM_KNOWN_HEADERS,
+};
+
+static const char *known_header_names[NUM_KNOWN_HEADERS] = {
+    "Content-Length",
+    "Connection",
+    "Host",
+    "If-Modified-Since",
+    "Range",
+    "Accept-Encoding",
+    "Transfer-Encoding",
+    "Referer",
+    "User-Agent",
+};
+static size_t known_header_hashes[NUM_KNOWN_HEADERS];
+
+struct HTTPRequest;
+
+/*
+ * リクエストボディ
+ *
+ * ボディは全部を受信し終えるまで溜めずに、受信バッファに届いた分からhandlerに渡して捨てる。
+ * そのため接続ごとのメモリはボディの大きさによらずヘッダ + チャンクの1行分で済む。
+ * chunkedで送られてきた場合はチャンクの区切りを取り除いた中身だけを渡す。
+ */
+enum BodyState {
+    BODY_DATA,          // Content-Lengthの残り
+    BODY_CHUNK_SIZE,    // チャンクのサイズの行
+    BODY_CHUNK_DATA,    // チャンクの中身
+    BODY_CHUNK_END,     // チャンクの後の改行
+    BODY_TRAILER,       // 最後のチャンクの後のトレーラー、空行で終わる
+    BODY_DONE,
 };
 
-struct HTTPRequest {
-    int protocol_minor_version;
-    char *method;
-    char *path;
-    struct HTTPHeaderField *header;
-    char *body;
-    long length;
-};
+struct RequestBody {
+    enum BodyState state;
+    long remaining;     // BODY_DATAとBODY_CHUNK_DATAでまだ届いていないバイト数
+    long received;      // handlerに渡したバイト数
+    // 届いた順に1回以上に分けて呼ばれる、dataは受信バッファ内を指すので呼ばれている間だけ使える
+    void (*handler)(struct HTTPRequest *req, char *data, size_t len);
+};
+
+struct HTTPRequest {
+    int protocol_minor_version;
+    struct Slice method;
+    struct Slice path;
+    struct HTTPHeaderField *header;    // 届いた順に並べた配列
+    int nheaders;
+    struct HTTPHeaderField *known[NUM_KNOWN_HEADERS];  // 無ければNULL、同じヘッダが複数あれば最初のもの
+    long length;    // Content-Length、chunkedなら-1
+    struct RequestBody body;
+    int keep_alive; // レスポンス後も接続を使い回すか
+};
+
+// 接続ごとの受信バッファ
+struct RecvBuffer {
+    char *buf;
+    size_t len;     // 受信済みバイト数
+    size_t cap;     // バッファのサイズ
+    size_t pos;     // 解析済みの位置 (ヘッダを解析し終えるまでは今のリクエストの先頭)
+    size_t scanned; // ヘッダの終わりを探し終えた位置
+};
+
+// parse_request()の戻り値
+enum {
+    PARSE_OK,
+    PARSE_AGAIN,    // ヘッダの終わりがまだ届いていない
+    PARSE_BAD_REQUEST,  // 400を返して接続を閉じる
+    PARSE_TOO_LARGE,    // 431を返して接続を閉じる
+    PARSE_BODY_TOO_LARGE,   // 413を返して接続を閉じる、ボディを読むときに返す
+};
+
+static void recv_buffer_init(struct RecvBuffer *rb) {
+    rb->cap = RECV_BUF_SIZE;
+    rb->buf = xmalloc(rb->cap);
+    rb->len = rb->pos = rb->scanned = 0;
+}
+
+static void recv_buffer_destroy(struct RecvBuffer *rb) {
+    free(rb->buf);
+    rb->buf = NULL;
+}
+
+static int slice_equals(struct Slice s, const char *str) {
+    return s.len == strlen(str) && memcmp(s.ptr, str, s.len) == 0;
+}
+
+// バッファを移したので、リクエストのスライスを新しいバッファの同じ位置に付け替える
+static void rebase_slice(struct Slice *s, char *from, char *to) {
+    s->ptr = to + (s->ptr - from);
+}
+
+// 受信バッファを広げる、reqを渡すとその中のスライスも付け替える
+// 古いバッファを指すポインタが残らないようにrealloc(3)ではなく新しく確保してコピーする
+static int recv_buffer_grow(struct RecvBuffer *rb, struct HTTPRequest *req) {
+    struct HTTPHeaderField *h;
+    char *buf;
+
+    if (rb->cap >= MAX_RECV_BUF_SIZE) return -1;
+    buf = xmalloc(rb->cap * 2);
+    memcpy(buf, rb->buf, rb->len);
+    if (req) {
+        rebase_slice(&req->method, rb->buf, buf);
+        rebase_slice(&req->path, rb->buf, buf);
+        for (h = req->header; h < req->header + req->nheaders; h++) {
+            rebase_slice(&h->name, rb->buf, buf);
+            rebase_slice(&h->value, rb->buf, buf);
+        }
+    }
+    free(rb->buf);
+    rb->buf = buf;
+    rb->cap *= 2;
+    return 0;
+}
+
+// ソケットから読めるだけ受信バッファに読み込む、reqは解析済みのリクエスト (まだなければNULL)
+// 1: データを読んだ, 0: まだ届いていない (EAGAIN、ブロッキングならタイムアウト), -1: EOF・エラー・バッファ上限超過
+static int recv_fill(struct RecvBuffer *rb, int fd, struct HTTPRequest *req) {
+    ssize_t n;
+
+    if (rb->len == rb->cap && recv_buffer_grow(rb, req) < 0) {
+        log_message(LOG_WARNING, "request too large");
+        return -1;
+    }
+    n = read(fd, rb->buf + rb->len, rb->cap - rb->len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return -1;
+    }
+    if (n == 0) return -1;
+    rb->len += n;
+    return 1;
+}
+
+// リクエストを処理し終えたので、パイプライン化されて既に届いている分をバッファの先頭に詰める
+static void recv_buffer_consume(struct RecvBuffer *rb) {
+    memmove(rb->buf, rb->buf + rb->pos, rb->len - rb->pos);
+    rb->len -= rb->pos;
+    rb->pos = rb->scanned = 0;
+}
+
+// ヘッダの終わり (空行の直後) を探す、まだ届いていなければNULLを返す
+static char *find_header_end(struct RecvBuffer *rb) {
+    char *p = rb->buf + rb->scanned;
+    char *end = rb->buf + rb->len;
+    char *nl, *next;
+
+    while ((nl = memchr(p, '\n', end - p))) {
+        next = nl + 1;
+        if (next < end && *next == '\r') next++;
+        if (next >= end) {
+            // 次の行が空行かどうかはまだ分からないので、この改行から探し直す
+            rb->scanned = nl - rb->buf;
+            return NULL;
+        }
+        if (*next == '\n') return next + 1;
+        p = nl + 1;
+    }
+    rb->scanned = rb->len;
+    return NULL;
+}
+
+// [line, end) から1行取り出す、eolに行末 (\r\nの\r、もしくは\n) を入れて次の行の先頭を返す
+static char *split_line(char *line, char *end, char **eol) {
+    char *nl;
+
+    nl = memchr(line, '\n', end - line);
+    *eol = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+    return nl + 1;
+}
+
+// GET /path/to/file HTTP/1.1 の部分を解析する
+static int parse_request_line(struct HTTPRequest *req, char *line, char *eol) {
+    char *p, *path, *version;
+
+    /* メソッド部分 */
+    p = memchr(line, ' ', eol - line);
+    if (!p || p == line) return -1;
+    req->method.ptr = line;
+    req->method.len = p - line;
+    *p = '\0';
+    for (p = line; *p; p++)
+        *p = (char)toupper((int)*p);
+
+    /* パス部分 */
+    path = req->method.ptr + req->method.len + 1;
+    p = memchr(path, ' ', eol - path);
+    if (!p || p == path) return -1;
+    req->path.ptr = path;
+    req->path.len = p - path;
+    *p = '\0';
+
+    /* HTTPバージョン部分 */
+    // 大文字小文字を無視しメジャーバージョンまで一致することを確認
+    version = p + 1;
+    if (eol - version < (long)strlen("HTTP/1.") + 1
+            || strncasecmp(version, "HTTP/1.", strlen("HTTP/1.")) != 0)
+        return -1;
+    *eol = '\0';
+    // マイナーバージョンを取り出す
+    req->protocol_minor_version = atoi(version + strlen("HTTP/1."));
+    return 0;
+}
+
+// ヘッダ名は大文字小文字を区別しないので、小文字にしながらFNV-1aでハッシュを取る
+static size_t hash_header_name(const char *name, size_t len) {
+    size_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= (unsigned char)tolower((unsigned char)*name++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void known_headers_init(void) {
+    int i;
+
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++)
+        known_header_hashes[i] = hash_header_name(known_header_names[i], strlen(known_header_names[i]));
+}
+
+static int header_name_equals(struct HTTPHeaderField *h, size_t hash, const char *name, size_t len) {
+    return h->hash == hash && h->name.len == len && strncasecmp(h->name.ptr, name, len) == 0;
+}
+
+// Connection: close のような1行を解析してhに入れる
+static int parse_header_field(struct HTTPHeaderField *h, char *line, char *eol) {
+    char *colon, *value;
+
+    // 継続行 (行頭が空白) は廃止された書き方なので受け付けない
+    colon = memchr(line, ':', eol - line);
+    if (!colon || colon == line || line[0] == ' ' || line[0] == '\t') return -1;
+
+    // 値の前後の空白は含めない
+    value = colon + 1;
+    while (value < eol && (*value == ' ' || *value == '\t'))
+        value++;
+    while (eol > value && (eol[-1] == ' ' || eol[-1] == '\t'))
+        eol--;
+
+    h->name.ptr = line;
+    h->name.len = colon - line;
+    h->hash = hash_header_name(line, h->name.len);
+    *colon = '\0';
+    h->value.ptr = value;
+    h->value.len = eol - value;
+    *eol = '\0';
+    return 0;
+}
+
+// よく参照するヘッダをスロットに割り当てる
+static void index_header_field(struct HTTPRequest *req, struct HTTPHeaderField *h) {
+    int i;
+
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++) {
+        if (header_name_equals(h, known_header_hashes[i], known_header_names[i], strlen(known_header_names[i]))) {
+            if (!req->known[i]) req->known[i] = h;
+            return;
+        }
+    }
+}
+
+// 受信バッファからリクエストラインとヘッダを解析する
+// PARSE_OKならrb->posはボディの先頭を指す、リクエストの構造体とヘッダの配列はarenaに確保する
+static int parse_request(struct RecvBuffer *rb, struct Arena *arena, struct HTTPRequest **reqp) {
+    struct HTTPRequest *req;
+    struct HTTPHeaderField *h;
+    char *line, *next, *eol, *end, *p;
+    long started = now_usec();
+    int n;
+
+    // リクエストの前の空行は読み飛ばしてよい (RFC 7230 3.5)
+    while (rb->pos < rb->len && (rb->buf[rb->pos] == '\r' || rb->buf[rb->pos] == '\n'))
+        rb->pos++;
+    if (rb->scanned < rb->pos) rb->scanned = rb->pos;
+
+    end = find_header_end(rb);
+    if (!end) {
+        if (rb->len - rb->pos >= MAX_REQUEST_HEADER_SIZE) {
+            log_message(LOG_WARNING, "request header too large");
+            return PARSE_TOO_LARGE;
+        }
+        return PARSE_AGAIN;
+    }
+    if (end - (rb->buf + rb->pos) > MAX_REQUEST_HEADER_SIZE) {
+        log_message(LOG_WARNING, "request header too large");
+        return PARSE_TOO_LARGE;
+    }
+
+    req = arena_alloc(arena, sizeof(struct HTTPRequest));
+    memset(req, 0, sizeof(struct HTTPRequest));
+    line = rb->buf + rb->pos;
+    next = split_line(line, end, &eol);
+    if (parse_request_line(req, line, eol) < 0) {
+        log_message(LOG_WARNING, "parse error on request line");
+        return PARSE_BAD_REQUEST;
+    }
+
+    // ヘッダの終わりまで届いているので先に行数を数え、ヘッダの配列を一度で確保する
+    // 最後の改行は空行の分なので数えない
+    n = -1;
+    for (p = next; (p = memchr(p, '\n', end - p)); p++)
+        n++;
+    req->header = arena_alloc(arena, sizeof(struct HTTPHeaderField) * (n > 0 ? n : 1));
+
+    for (line = next; ; line = next) {
+        next = split_line(line, end, &eol);
+        if (eol == line) break;     // 空行
+        h = &req->header[req->nheaders];
+        if (parse_header_field(h, line, eol) < 0) {
+            log_message(LOG_WARNING, "parse error on request header field");
+            return PARSE_BAD_REQUEST;
+        }
+        index_header_field(req, h);
+        req->nheaders++;
+    }
+
+    rb->pos = rb->scanned = end - rb->buf;
+    *reqp = req;
+    stats_record_latency(LAT_PARSE, now_usec() - started);
+    return PARSE_OK;
+}
+
+// よく参照するヘッダの値を返す、無ければNULL
+static char *known_header_value(struct HTTPRequest *req, enum KnownHeader id) {
+    return req->known[id] ? req->known[id]->value.ptr : NULL;
+}
+
+// それ以外のヘッダはハッシュ値を比べながら配列を走査する
+static char *lookup_header_field_value(struct HTTPRequest *req, char *field_name) {
+    struct HTTPHeaderField *h;
+    size_t len = strlen(field_name);
+    size_t hash = hash_header_name(field_name, len);
+
+    for (h = req->header; h < req->header + req->nheaders; h++) {
+        // ヘッダーは大文字小文字を無視して比較する
+        if (header_name_equals(h, hash, field_name, len))
+            return h->value.ptr;
+    }
+
+    return NULL;
+}
+
+// カンマ区切りのヘッダ値 (Connection: keep-alive, Upgrade など) にtokenが含まれているか
+static int header_has_token(char *value, char *token) {
+    size_t len = strlen(token);
+    char *p = value;
+
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (strncasecmp(p, token, len) == 0 && strchr(" \t,", p[len]))
+            return 1;
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+// HTTP/1.1は明示的にcloseされない限り、HTTP/1.0はkeep-aliveを指定された場合だけ接続を使い回す
+static int wants_keep_alive(struct HTTPRequest *req) {
+    char *val;
+
+    val = known_header_value(req, HDR_CONNECTION);
+    if (val && header_has_token(val, "close")) return 0;
+    if (req->protocol_minor_version >= 1) return 1;
+    return val && header_has_token(val, "keep-alive");
+}
+
+// 不正な値なら-1を返す、上限を超える値は桁あふれさせずにLONG_MAXにする
+static long content_length(struct HTTPRequest *req) {
+    char *val, *end;
+    long len;
+
+    val = known_header_value(req, HDR_CONTENT_LENGTH);
+    if (!val) return 0;
+
+    // atol(3)は符号や後ろのゴミを受け付けてしまうので数字だけを許す
+    if (!isdigit((unsigned char)*val)) return -1;
+    errno = 0;
+    len = strtol(val, &end, 10);
+    if (*end != '\0') return -1;
+    if (errno == ERANGE) return LONG_MAX;
+
+    return len;
+}
+
+// 今はボディを使うハンドラが無いので読み捨てる
+// アップロードを受け付ける場合は、begin_request_body()でメソッドとパスからハンドラを選ぶ
+static void discard_request_body(struct HTTPRequest *req, char *data, size_t len) {
+    ;
+}
+
+// ヘッダを解析し終えたリクエストのボディの長さと形式を確かめ、ボディを読む準備をする
+// PARSE_OKかエラーのどちらかを返す
+static int begin_request_body(struct HTTPRequest *req) {
+    struct RequestBody *body = &req->body;
+    char *te;
+
+    body->handler = discard_request_body;
+    te = known_header_value(req, HDR_TRANSFER_ENCODING);
+    if (te) {
+        // 両方あると前段のプロキシとボディの区切りが食い違いうる (リクエストスマグリング) ので受け付けない
+        if (known_header_value(req, HDR_CONTENT_LENGTH)) {
+            log_message(LOG_WARNING, "both Transfer-Encoding and Content-Length");
+            return PARSE_BAD_REQUEST;
+        }
+        // chunked以外の転送コーディングはボディの終わりが分からないので扱えない
+        if (strcasecmp(te, "chunked") != 0) {
+            log_message(LOG_WARNING, "unsupported Transfer-Encoding: %s", te);
+            return PARSE_BAD_REQUEST;
+        }
+        req->length = -1;
+        body->state = BODY_CHUNK_SIZE;
+        return PARSE_OK;
+    }
+
+    req->length = content_length(req);
+    if (req->length < 0) {
+        log_message(LOG_WARNING, "invalid Content-Length value");
+        return PARSE_BAD_REQUEST;
+    }
+    if (req->length > max_request_body) {
+        log_message(LOG_WARNING, "request body too long: %ld", req->length);
+        return PARSE_BODY_TOO_LARGE;
+    }
+    body->remaining = req->length;
+    body->state = req->length > 0 ? BODY_DATA : BODY_DONE;
+    return PARSE_OK;
+}
+
+// チャンクのサイズの行を解析する、不正なら-1を返す
+static long parse_chunk_size(char *p, char *eol) {
+    long size = 0;
+    int ndigits = 0;
+
+    if (eol > p && eol[-1] == '\r') eol--;
+    for (; p < eol && isxdigit((unsigned char)*p); p++) {
+        // 16進15桁までならlongで桁あふれしない
+        if (++ndigits > 15) return -1;
+        size = size * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+    }
+    if (ndigits == 0) return -1;
+    // チャンク拡張 (;name=value) は使わないので読み飛ばす
+    if (p < eol && *p != ';' && *p != ' ' && *p != '\t') return -1;
+    return size;
+}
+
+// 受信バッファに届いているボディをhandlerに渡す
+// PARSE_OK: 読み終えた, PARSE_AGAIN: 続きを待つ, それ以外はエラー
+// 渡し終えた分はヘッダの直後まで詰めて捨てるので、受信バッファはボディの大きさに比例して大きくならない
+// 読み終えたらrb->posは次のリクエストの先頭を指す
+static int read_request_body(struct HTTPRequest *req, struct RecvBuffer *rb) {
+    struct RequestBody *body = &req->body;
+    char *start = rb->buf + rb->pos;
+    char *p = start, *end = rb->buf + rb->len;
+    char *line, *nl;
+    long size;
+    size_t n;
+    int r = PARSE_AGAIN;
+
+    while (r == PARSE_AGAIN) {
+        if (body->state == BODY_DONE) {
+            r = PARSE_OK;
+            break;
+        }
+        if (body->state == BODY_DATA || body->state == BODY_CHUNK_DATA) {
+            n = end - p;
+            if (n > (size_t)body->remaining) n = body->remaining;
+            if (n > 0) {
+                body->handler(req, p, n);
+                p += n;
+                body->remaining -= n;
+                body->received += n;
+            }
+            if (body->remaining > 0) break;
+            body->state = body->state == BODY_DATA ? BODY_DONE : BODY_CHUNK_END;
+            continue;
+        }
+
+        // 残りの状態は1行ずつ読む
+        nl = memchr(p, '\n', end - p);
+        if (!nl) {
+            if (end - p >= MAX_CHUNK_LINE_SIZE) {
+                log_message(LOG_WARNING, "chunk line too long");
+                r = PARSE_BAD_REQUEST;
+            }
+            break;
+        }
+        line = p;
+        p = nl + 1;
+        switch (body->state) {
+        case BODY_CHUNK_SIZE:
+            size = parse_chunk_size(line, nl);
+            if (size < 0) {
+                log_message(LOG_WARNING, "invalid chunk size");
+                r = PARSE_BAD_REQUEST;
+            } else if (size > max_request_body - body->received) {
+                log_message(LOG_WARNING, "request body too long: %ld", body->received + size);
+                r = PARSE_BODY_TOO_LARGE;
+            } else {
+                body->remaining = size;
+                body->state = size > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+            }
+            break;
+        case BODY_CHUNK_END:
+            if (nl - line > 1 || (nl - line == 1 && *line != '\r')) {
+                log_message(LOG_WARNING, "missing CRLF after chunk data");
+                r = PARSE_BAD_REQUEST;
+            }
+            body->state = BODY_CHUNK_SIZE;
+            break;
+        case BODY_TRAILER:
+            // トレーラーのヘッダは使わないので空行まで読み飛ばす
+            if (nl - line == 0 || (nl - line == 1 && *line == '\r'))
+                body->state = BODY_DONE;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (r == PARSE_OK) {
+        rb->pos = p - rb->buf;
+    } else if (r == PARSE_AGAIN) {
+        memmove(start, p, end - p);
+        rb->len -= p - start;
+    }
+    rb->scanned = rb->pos;
+    return r;
+}
+
+// Expect: 100-continueを付けたクライアントはボディを送る前に100 Continueを待つので、まだ届いていなければ送る
+// 送れなかった場合は-1を返す
+static int send_continue(int fd, struct HTTPRequest *req, struct RecvBuffer *rb) {
+    static const char msg[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    char *val;
+
+    if (req->body.state == BODY_DONE || rb->len > rb->pos || req->protocol_minor_version < 1) return 0;
+    val = lookup_header_field_value(req, "Expect");
+    if (!val || strcasecmp(val, "100-continue") != 0) return 0;
+    // 空の接続への小さな書き込みなので、ノンブロッキングでも一度に送れなければ諦めて閉じる
+    if (send(fd, msg, sizeof msg - 1, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof msg - 1) return -1;
+    return 0;
+}
+
+// ブロッキングのソケットのread(2)がsec秒待っても届かなければ諦めるようにする
+static void set_recv_timeout(int fd, long sec) {
+    struct timeval tv = { .tv_sec = sec, .tv_usec = 0 };
+
+    // debug()ではファイルから読むので失敗しても構わない
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// ブロッキングのソケットから1リクエスト読む、nrequestsはこの接続で何番目のリクエストか
+// 最初のリクエストはheader_timeout秒、keep-aliveの2番目以降はkeepalive_timeout秒まで届き始めるのを待ち、
+// 届き始めたらheader_timeout秒以内にヘッダを受け取り終えなければ閉じる
+// SO_RCVTIMEOは1回のread(2)ごとの時間で、シグナルで中断されると数え直しになるので、期限は別に確かめる
+// PARSE_OKなら*reqpにリクエストを入れる、リクエストが不正ならエラーを返すのでエラーページを送って接続を閉じる
+// 途中で閉じられた (もしくはタイムアウトした) 場合は-1を返す、ここではプロセスを終了させない
+// リクエストはarenaに、文字列はrbの中にあるので、使い終わったらarena_reset()とrecv_buffer_consume()で捨てる
+static int read_request(int fd, struct RecvBuffer *rb, struct Arena *arena, struct HTTPRequest **reqp, int nrequests) {
+    struct HTTPRequest *req;
+    time_t now, deadline;
+    int in_header = 0;
+    int r, n;
+
+    deadline = time(NULL) + (nrequests == 1 ? header_timeout : keepalive_timeout);
+    while ((r = parse_request(rb, arena, &req)) == PARSE_AGAIN) {
+        now = time(NULL);
+        if (!in_header && rb->len > rb->pos) {
+            in_header = 1;
+            deadline = now + header_timeout;
+        }
+        // 終了を待っている間は、keep-aliveで次のリクエストを待っているだけの接続は閉じる
+        if (draining && nrequests > 1 && !in_header) return -1;
+        if (now >= deadline) {
+            if (in_header) log_message(LOG_INFO, "timed out reading request header");
+            return -1;
+        }
+        set_recv_timeout(fd, deadline - now);
+        // 0はタイムアウトかシグナルでの中断、期限はループの先頭で確かめる
+        if ((n = recv_fill(rb, fd, NULL)) < 0) {
+            // keep-aliveでは次のリクエストを送らずに切断されるのは正常なのでログも出さない
+            if (in_header)
+                log_message(LOG_INFO, "connection closed while reading request header");
+            return -1;
+        }
+    }
+    if (r != PARSE_OK) return r;
+
+    // リクエストのエンティティボディを読む、GETの場合は普通は無い
+    if ((r = begin_request_body(req)) != PARSE_OK) return r;
+    if (send_continue(fd, req, rb) < 0) return -1;
+    if (req->body.state != BODY_DONE) set_recv_timeout(fd, body_timeout);
+    while ((r = read_request_body(req, rb)) == PARSE_AGAIN) {
+        if ((n = recv_fill(rb, fd, req)) < 0 || (n == 0 && errno != EINTR)) {
+            log_message(LOG_INFO, "connection closed while reading request body");
+            return -1;
+        }
+    }
+    if (r != PARSE_OK) return r;
+
+    *reqp = req;
+    return PARSE_OK;
+}
+
+static char *build_fspath(char *docroot, char *urlpath) {
+    char *path;
+    //                            スラッシュ              NULL文字
+    path = xmalloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
+    sprintf(path, "%s/%s", docroot, urlpath);
+
+    return path;
+}
+
+/*
+ * MIMEタイプの表
+ *
+ * 起動時にmime.types (「タイプ 拡張子 拡張子...」の形式) を読み、拡張子をキーにしたハッシュ表を作る。
+ * 拡張子は大文字小文字を区別しないので、ヘッダ名と同じく小文字にしながらハッシュを取る。
+ * 引くときは文字列をコピーせずにURLのパスの中の拡張子をそのまま比べる。
+ * ファイルが読めない場合は組み込みの最低限の表を使う。
+ */
+#define DEFAULT_MIME_TYPES "/etc/mime.types"
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+#define MIME_TABLE_INITIAL_SIZE 1024
+
+static const char builtin_mime_types[] =
+    "text/html html htm\n"
+    "text/css css\n"
+    "text/plain txt\n"
+    "text/xml xml\n"
+    "application/javascript js mjs\n"
+    "application/json json\n"
+    "application/pdf pdf\n"
+    "application/wasm wasm\n"
+    "application/gzip gz\n"
+    "image/png png\n"
+    "image/jpeg jpg jpeg\n"
+    "image/gif gif\n"
+    "image/webp webp\n"
+    "image/svg+xml svg\n"
+    "image/x-icon ico\n"
+    "font/woff woff\n"
+    "font/woff2 woff2\n"
+    "video/mp4 mp4\n";
+
+struct MimeEntry {
+    char *ext;      // NULLなら空き
+    size_t ext_len;
+    size_t hash;
+    char *type;     // 同じタイプの拡張子同士で共有する
+    int owns_type;  // typeを複製したエントリ、表を解放するときにこのエントリがtypeを解放する
+};
+
+struct MimeTable {
+    struct MimeEntry *slots;    // オープンアドレス法、要素数は2のべき乗
+    size_t nslots;
+    size_t count;
+    int refcnt;     // 今の表であることで1つ、表の中のタイプを指しているFileInfoが1つずつ持つ
+    struct MimeTable *retired_next; // 差し替えた後、引いている最中のスレッドがいなくなるのを待っている表のリスト
+};
+
+static struct MimeTable *mime_table;    // SIGHUPで読み直したら新しい表に差し替える
+static struct MimeTable *mime_retired;  // 差し替えたが、まだ引いているスレッドがいたかもしれない表
+static int mime_table_readers = 0;      // lookup_mime_type()の最中のスレッド数
+
+static char *mime_types_path = DEFAULT_MIME_TYPES;
+
+// 拡張子のスロットを探す、無ければ空きスロットを返す
+static struct MimeEntry *mime_slot(struct MimeEntry *slots, size_t nslots, const char *ext, size_t len, size_t hash) {
+    struct MimeEntry *e;
+    size_t i;
+
+    for (i = hash & (nslots - 1); ; i = (i + 1) & (nslots - 1)) {
+        e = &slots[i];
+        if (!e->ext) return e;
+        if (e->hash == hash && e->ext_len == len && strncasecmp(e->ext, ext, len) == 0) return e;
+    }
+}
+
+static void mime_table_grow(struct MimeTable *t) {
+    struct MimeEntry *old = t->slots, *e;
+    size_t i, n = t->nslots;
+
+    t->nslots = n ? n * 2 : MIME_TABLE_INITIAL_SIZE;
+    t->slots = xmalloc(sizeof(struct MimeEntry) * t->nslots);
+    memset(t->slots, 0, sizeof(struct MimeEntry) * t->nslots);
+    for (i = 0; i < n; i++) {
+        if (!old[i].ext) continue;
+        e = mime_slot(t->slots, t->nslots, old[i].ext, old[i].ext_len, old[i].hash);
+        *e = old[i];
+    }
+    free(old);
+}
+
+// 同じ拡張子が複数回出てきたら最初のものを使う
+// タイプの文字列は初めて登録するときに複製し、*sharedに入れて同じ行の拡張子で共有する
+static void mime_table_add(struct MimeTable *t, char *ext, const char *type, char **shared) {
+    struct MimeEntry *e;
+    size_t len = strlen(ext);
+    size_t hash = hash_header_name(ext, len);
+
+    // 半分以上埋まったら広げて、探す距離が伸びないようにする
+    if ((t->count + 1) * 2 > t->nslots) mime_table_grow(t);
+    e = mime_slot(t->slots, t->nslots, ext, len, hash);
+    if (e->ext) return;
+    if (!*shared) {
+        if (!(*shared = strdup(type))) log_exit("failed to allocate memory");
+        e->owns_type = 1;
+    }
+    e->ext = strdup(ext);
+    if (!e->ext) log_exit("failed to allocate memory");
+    e->ext_len = len;
+    e->hash = hash;
+    e->type = *shared;
+    t->count++;
+}
+
+// mime.types形式の1行を登録する
+static void mime_table_add_line(struct MimeTable *t, char *line) {
+    char *type, *ext, *save, *shared = NULL;
+
+    line[strcspn(line, "#")] = '\0';
+    type = strtok_r(line, " \t\r\n", &save);
+    if (!type) return;
+    while ((ext = strtok_r(NULL, " \t\r\n", &save)))
+        mime_table_add(t, ext, type, &shared);
+}
+
+// mime.types (fがNULLなら組み込みの表だけ) から表を作る
+static struct MimeTable *mime_table_load(FILE *f) {
+    struct MimeTable *t;
+    char *line = NULL, *buf, *p, *save;
+    size_t cap = 0;
+
+    t = xmalloc(sizeof(struct MimeTable));
+    memset(t, 0, sizeof(struct MimeTable));
+    mime_table_grow(t);
+    t->refcnt = 1;
+    if (f) {
+        while (getline(&line, &cap, f) >= 0)
+            mime_table_add_line(t, line);
+        free(line);
+    }
+    // mime.typesに無いものは組み込みの表で補う
+    buf = strdup(builtin_mime_types);
+    if (!buf) log_exit("failed to allocate memory");
+    for (p = strtok_r(buf, "\n", &save); p; p = strtok_r(NULL, "\n", &save))
+        mime_table_add_line(t, p);
+    free(buf);
+    return t;
+}
+
+static void mime_table_free(struct MimeTable *t) {
+    size_t i;
+
+    for (i = 0; i < t->nslots; i++) {
+        if (!t->slots[i].ext) continue;
+        free(t->slots[i].ext);
+        if (t->slots[i].owns_type) free(t->slots[i].type);
+    }
+    free(t->slots);
+    free(t);
+}
+
+// 最後の参照を手放したら解放する、FileInfoの解放はどのスレッドからも呼ばれる
+static void mime_table_release(struct MimeTable *t) {
+    if (t && __atomic_sub_fetch(&t->refcnt, 1, __ATOMIC_SEQ_CST) == 0) mime_table_free(t);
+}
+
+// chroot(2)する前に呼ぶ
+static void mime_types_init(void) {
+    FILE *f;
+
+    f = fopen(mime_types_path, "re");
+    if (!f)
+        log_message(LOG_WARNING, "failed to open %s: %s, using builtin MIME types",
+                    mime_types_path, strerror(errno));
+    mime_table = mime_table_load(f);
+    if (f) fclose(f);
+}
+
+// SIGHUPでmime.typesを読み直す、読めなければ今の表を使い続ける
+// 差し替えた後で引いている最中のスレッドがいなければ、古い表の「今の表」としての参照を手放す
+// 古い表のタイプを指しているFileInfoが残っていれば、最後のものが解放されたときに表も解放される
+// 引いている最中のスレッドがいれば次の読み直しまで待つ (SIGHUPを受けるのはメインスレッドだけなので、ここは同時には呼ばれない)
+static void mime_types_reload(void) {
+    FILE *f;
+    struct MimeTable *t, *old;
+
+    f = fopen(mime_types_path, "re");
+    if (!f) {
+        log_message(LOG_WARNING, "failed to reopen %s: %s, keeping current MIME types",
+                    mime_types_path, strerror(errno));
+        return;
+    }
+    t = mime_table_load(f);
+    fclose(f);
+    // スレッドモードでは他のスレッドが引いている最中でも、作り終えた表に一度に切り替わる
+    old = mime_table;
+    __atomic_store_n(&mime_table, t, __ATOMIC_SEQ_CST);
+    old->retired_next = mime_retired;
+    mime_retired = old;
+    // 差し替えより後に数を読むので、0なら以後に引き始めたスレッドは新しい表を見る
+    if (__atomic_load_n(&mime_table_readers, __ATOMIC_SEQ_CST) > 0) return;
+    while (mime_retired) {
+        old = mime_retired;
+        mime_retired = old->retired_next;
+        mime_table_release(old);
+    }
+}
+
+// URLのパスの拡張子からタイプを引く、返すのは表の中の文字列で複製はしない
+// 表の中を指すときは*tableに表を入れて参照を1つ増やすので、使い終わったらmime_table_release()する
+static const char *lookup_mime_type(const char *urlpath, struct MimeTable **table) {
+    const char *base, *dot, *type = DEFAULT_CONTENT_TYPE;
+    struct MimeTable *t;
+    struct MimeEntry *e;
+    size_t len;
+
+    *table = NULL;
+    base = strrchr(urlpath, '/');
+    base = base ? base + 1 : urlpath;
+    dot = strrchr(base, '.');
+    // 数を増やしてから表を読む、mime_types_reload()はこの間の表を解放しない
+    __atomic_add_fetch(&mime_table_readers, 1, __ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&mime_table, __ATOMIC_SEQ_CST);
+    if (dot && dot[1] != '\0') {
+        dot++;
+        len = strlen(dot);
+        e = mime_slot(t->slots, t->nslots, dot, len, hash_header_name(dot, len));
+        if (e->ext) {
+            type = e->type;
+            __atomic_add_fetch(&t->refcnt, 1, __ATOMIC_SEQ_CST);
+            *table = t;
+        }
+    }
+    __atomic_sub_fetch(&mime_table_readers, 1, __ATOMIC_SEQ_CST);
+    return type;
+}
+
+/*
+ * 圧縮したレスポンス
+ *
+ * --precompressed: file.br・file.gz があり、クライアントが受け付けるならそちらを送る
+ * --gzip: 圧縮済みのファイルが無ければテキストをその場でgzipで圧縮する、結果はレスポンスキャッシュに置く
+ */
+enum ContentEncoding {
+    ENC_IDENTITY,
+    ENC_GZIP,
+    ENC_BR,
+};
+
+static const char *encoding_names[] = { "identity", "gzip", "br" };
+static const char *encoding_suffixes[] = { "", ".gz", ".br" };
+
+#define GZIP_MIN_LENGTH 256  // これより小さいと圧縮してもヘッダの分で得にならない
+
+// 圧縮するかどうかで返す内容が変わるので、キャッシュにVary: Accept-Encodingを伝える
+static int negotiates_encoding(void) {
+    return precompressed || gzip_on_the_fly;
+}
+
+struct FileInfo {
+    char *urlpath;  // キャッシュのキー
+    enum ContentEncoding encoding;  // ENC_IDENTITY以外ならurlpathを圧縮した兄弟のファイル (file.gzなど)
+    char *path;
+    const char *content_type;   // 拡張子から引いたもの、圧縮済みのファイルでも元のファイルのタイプ
+    struct MimeTable *mime;     // content_typeが指している表、表の外の文字列ならNULL
+    long size;
+    int ok;
+    int transient;  // fdが足りないなどの一時的なエラーで開けなかった、キャッシュせずに500を返す
+    int is_dir;     // ディレクトリ、okならfdはその一覧を書いたメモリ上のファイル
+    int fd;         // 開いたままにしておくfd、okでなければ-1
+    ino_t ino;      // 以下は変更の検知に使う
+    time_t mtime;
+    long mtime_nsec;
+    char *etag;     // "inode-サイズ-更新時刻" をダブルクォートで囲んだもの
+    char *gzip_etag;    // その場でgzipで圧縮して返すときのETag
+    char last_modified[64];
+    char *header;   // Content-Length・Content-Type・Last-Modified・ETagのヘッダ、ファイルごとに固定なので作っておく
+    time_t checked_at;  // 最後にlstat(2)で確かめた時刻
+    int refcnt;     // 参照しているリクエスト数 (キャッシュに登録されていればキャッシュ自身も1つ持つ)
+    struct FileInfo *hash_next;
+    struct FileInfo *lru_prev, *lru_next;
+};
+
+static const char *guess_content_type(struct FileInfo *info) {
+    return info->content_type;
+}
+
+/*
+ * ファイル情報のキャッシュ
+ *
+ * URLのパスをキーに、lstat(2)の結果と開いたfd、レスポンスヘッダを覚えておく。
+ * 同じファイルへのリクエストが続く間はパスの組み立て・lstat(2)・open(2)をしなくて済む。
+ * file_cache_ttl秒経ったエントリは次に使うときにlstat(2)し直し、inode・サイズ・mtimeが
+ * 変わっていれば作り直す。エントリ数がfile_cache_entriesを超えたら最も古く使われたものから捨てる。
+ * スレッドモードでは全スレッドで共有するのでmutexで守る。
+ * 接続ごとにforkするモードでは子プロセスが終わるとキャッシュも消えるので効果はない。
+ * エントリはそれぞれfdを開いたままにするので、エントリ数はRLIMIT_NOFILEから接続などの分を
+ * 引いた数までにする。それでもfdが足りなくなったら、使われていないエントリを捨ててから開き直す。
+ */
+struct FileCache {
+    pthread_mutex_t lock;
+    struct FileInfo **buckets;
+    size_t nbuckets;
+    int count;
+    struct FileInfo *lru_head, *lru_tail;   // headが最も最近使われたもの
+};
+
+static struct FileCache file_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, NULL };
+
+// FNV-1a
+static size_t hash_string(const char *str) {
+    size_t h = 2166136261u;
+
+    for (; *str; str++) {
+        h ^= (unsigned char)*str;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void destroy_fileinfo(struct FileInfo *info) {
+    if (info->fd >= 0) close(info->fd);
+    free(info->urlpath);
+    free(info->path);
+    mime_table_release(info->mime);
+    free(info->etag);
+    free(info->gzip_etag);
+    free(info->header);
+    free(info);
+}
+
+static void free_fileinfo(struct FileInfo *info) {
+    int destroy;
+
+    pthread_mutex_lock(&file_cache.lock);
+    destroy = (--info->refcnt == 0);
+    pthread_mutex_unlock(&file_cache.lock);
+    if (destroy) destroy_fileinfo(info);
+}
+
+static void lru_unlink(struct FileInfo *info) {
+    if (info->lru_prev) info->lru_prev->lru_next = info->lru_next;
+    else file_cache.lru_head = info->lru_next;
+    if (info->lru_next) info->lru_next->lru_prev = info->lru_prev;
+    else file_cache.lru_tail = info->lru_prev;
+}
+
+static void lru_push_front(struct FileInfo *info) {
+    info->lru_prev = NULL;
+    info->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head) file_cache.lru_head->lru_prev = info;
+    else file_cache.lru_tail = info;
+    file_cache.lru_head = info;
+}
+
+// キャッシュから外してキャッシュの持つ参照を手放す、使用中なら最後のfree_fileinfo()で解放される
+// file_cache.lockを取った状態で呼ぶ
+static void file_cache_remove(struct FileInfo *info) {
+    struct FileInfo **p;
+
+    p = &file_cache.buckets[hash_string(info->urlpath) & (file_cache.nbuckets - 1)];
+    while (*p != info) p = &(*p)->hash_next;
+    *p = info->hash_next;
+    lru_unlink(info);
+    file_cache.count--;
+    if (--info->refcnt == 0) destroy_fileinfo(info);
+}
+
+// reserved_fdsは接続とlistening socketで使うfdの数
+static void file_cache_init(int reserved_fds) {
+    struct rlimit rl;
+    size_t n = 1;
+    long avail;
+
+    if (file_cache_entries == 0) return;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        avail = (long)rl.rlim_cur - reserved_fds - FILE_CACHE_FD_RESERVE;
+        // 接続が上限まで張り付くことはまれなので、キャッシュにも最低限は残す
+        if (avail < (long)rl.rlim_cur / 4) avail = rl.rlim_cur / 4;
+        if (avail < file_cache_entries) {
+            log_message(LOG_INFO, "file cache limited to %ld entries by RLIMIT_NOFILE (%ld)",
+                        avail, (long)rl.rlim_cur);
+            file_cache_entries = avail;
+            if (file_cache_entries == 0) return;
+        }
+    }
+    // 負荷率が0.5以下になるように2のべき乗で確保する
+    while (n < (size_t)file_cache_entries * 2) n <<= 1;
+    file_cache.buckets = xmalloc(sizeof(struct FileInfo *) * n);
+    memset(file_cache.buckets, 0, sizeof(struct FileInfo *) * n);
+    file_cache.nbuckets = n;
+}
+
+/*
+ * ディレクトリの一覧
+ *
+ * 末尾が/のURLがディレクトリを指していて、DIRECTORY_INDEXが無ければ一覧のHTMLを作って返す。
+ * 作った一覧はmemfd_create(2)のメモリ上のファイルに書き、普通のファイルと同じように
+ * FileInfoのfdとしてファイル情報のキャッシュに置く。sendfile(2)・Range・条件付きGET・
+ * レスポンスキャッシュもそのまま使える。
+ * 一覧はエントリの名前だけなので、ディレクトリのmtimeが変わらない限り (エントリの追加・削除・
+ * 改名が無い限り) 作り直さない。
+ * エントリが多くてもメモリに溜めずにreaddir(3)しながら書き出す。そのため並べ替えはしない。
+ */
+#define DIRECTORY_INDEX "index.html"
+#define LISTING_CONTENT_TYPE "text/html; charset=utf-8"
+#define LISTING_BUF_SIZE (64 * 1024)
+
+static void output_html_escaped(FILE *f, const char *str) {
+    for (; *str; str++) {
+        switch (*str) {
+        case '&': fputs("&amp;", f); break;
+        case '<': fputs("&lt;", f); break;
+        case '>': fputs("&gt;", f); break;
+        case '"': fputs("&quot;", f); break;
+        default: putc(*str, f); break;
+        }
+    }
+}
+
+// d_typeを返さないファイルシステムではlstat(2)して確かめる
+static int dirent_is_directory(DIR *d, struct dirent *ent) {
+    struct stat st;
+
+    if (ent->d_type != DT_UNKNOWN) return ent->d_type == DT_DIR;
+    if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) return 0;
+    return S_ISDIR(st.st_mode);
+}
+
+// 一覧のHTMLを書いたメモリ上のファイルを作ってfdを返す
+// 作れなければerrnoに理由を残して-1を返す、呼び出し側はそれでキャッシュしてよいか決める
+static int render_directory_listing(const char *path, const char *urlpath, long *size) {
+    DIR *d;
+    struct dirent *ent;
+    FILE *f;
+    int fd, dup_fd, is_dir, err;
+
+    d = opendir(path);
+    if (!d) return -1;
+    fd = memfd_create("listing", MFD_CLOEXEC);
+    if (fd < 0) {
+        err = errno;
+        log_message(LOG_WARNING, "memfd_create(2) failed: %s", strerror(err));
+        closedir(d);
+        errno = err;
+        return -1;
+    }
+    // fclose(3)でfdが閉じられるので、書き込みには複製を渡す
+    dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    f = dup_fd < 0 ? NULL : fdopen(dup_fd, "w");
+    if (!f) {
+        err = errno;
+        if (dup_fd >= 0) close(dup_fd);
+        close(fd);
+        closedir(d);
+        errno = err;
+        return -1;
+    }
+    setvbuf(f, NULL, _IOFBF, LISTING_BUF_SIZE);
+    fputs("<html>\r\n<head><title>Index of ", f);
+    output_html_escaped(f, urlpath);
+    fputs("</title></head>\r\n<body>\r\n<h1>Index of ", f);
+    output_html_escaped(f, urlpath);
+    fputs("</h1>\r\n<ul>\r\n", f);
+    while ((ent = readdir(d))) {
+        if (strcmp(ent->d_name, ".") == 0) continue;
+        if (strcmp(ent->d_name, "..") == 0 && strcmp(urlpath, "/") == 0) continue;
+        is_dir = dirent_is_directory(d, ent);
+        // URLの%xxはデコードしないので、名前はそのままリンクにする
+        // "./"を付けて、:を含む名前がスキームと解釈されないようにする
+        fputs("<li><a href=\"./", f);
+        output_html_escaped(f, ent->d_name);
+        fputs(is_dir ? "/\">" : "\">", f);
+        output_html_escaped(f, ent->d_name);
+        fputs(is_dir ? "/</a></li>\r\n" : "</a></li>\r\n", f);
+    }
+    fputs("</ul>\r\n</body>\r\n</html>\r\n", f);
+    closedir(d);
+    if (fclose(f) != 0) {
+        err = errno;
+        log_message(LOG_WARNING, "failed to write directory listing of %s: %s", path, strerror(err));
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    *size = lseek(fd, 0, SEEK_END);
+    return fd;
+}
+
+static int has_trailing_slash(const char *urlpath) {
+    size_t len = strlen(urlpath);
+
+    return len > 0 && urlpath[len - 1] == '/';
+}
+
+// SIGHUPで全部捨てる、使用中のものは最後のfree_fileinfo()で解放される
+static void file_cache_flush(void) {
+    pthread_mutex_lock(&file_cache.lock);
+    while (file_cache.lru_tail)
+        file_cache_remove(file_cache.lru_tail);
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+// fdが足りないときに、リクエストが使っていないエントリを古いものから捨ててfdを空ける
+// 1つでも捨てられたら1を返すので、呼び出し側は開き直す
+static int file_cache_release_fds(void) {
+    struct FileInfo *info, *prev;
+    int n = 0;
+
+    if (file_cache_entries == 0) return 0;
+    pthread_mutex_lock(&file_cache.lock);
+    for (info = file_cache.lru_tail; info && n < FILE_CACHE_EVICT_ON_EMFILE; info = prev) {
+        prev = info->lru_prev;
+        // キャッシュだけが持っているものなら、外せばすぐにfdが閉じられる
+        if (info->refcnt != 1 || info->fd < 0) continue;
+        file_cache_remove(info);
+        n++;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return n > 0;
+}
+
+static int fd_exhausted(int err) {
+    return err == EMFILE || err == ENFILE;
+}
+
+// 無い・読めないという結果は、ファイルが変わるまで同じなのでキャッシュしてよい
+// それ以外 (fdやメモリが足りないなど) をキャッシュすると、回復してもTTLの間404を返し続けてしまう
+static void fileinfo_set_error(struct FileInfo *info, int err) {
+    if (err == ENOENT || err == ENOTDIR || err == EACCES) return;
+    log_message(LOG_WARNING, "failed to open %s: %s", info->path, strerror(err));
+    info->transient = 1;
+}
+
+// キャッシュを使わずにファイル情報を作る
+static struct FileInfo *load_fileinfo(char *docroot, char *urlpath, enum ContentEncoding encoding) {
+    struct FileInfo *info;
+    struct stat st;
+    struct tm tm;
+    char *path;
+
+    info = xmalloc(sizeof(struct FileInfo));
+    memset(info, 0, sizeof(struct FileInfo));
+    info->urlpath = strdup(urlpath);
+    if (!info->urlpath) log_exit("failed to allocate memory");
+    info->encoding = encoding;
+    info->content_type = lookup_mime_type(urlpath, &info->mime);
+    path = build_fspath(docroot, urlpath);
+    if (asprintf(&info->path, "%s%s", path, encoding_suffixes[encoding]) < 0)
+        log_exit("failed to allocate memory");
+    free(path);
+    info->ok = 0;
+    info->fd = -1;
+    info->refcnt = 1;
+    info->checked_at = time(NULL);
+    if (lstat(info->path, &st) < 0) {
+        fileinfo_set_error(info, errno);
+        return info;
+    }
+    info->ino = st.st_ino;
+    info->mtime = st.st_mtim.tv_sec;
+    info->mtime_nsec = st.st_mtim.tv_nsec;
+    if (S_ISDIR(st.st_mode)) {
+        info->is_dir = 1;
+        // 末尾に/が無ければ一覧は作らず、呼び出し側で/付きのURLへリダイレクトする
+        if (encoding != ENC_IDENTITY || !has_trailing_slash(urlpath)) return info;
+        info->fd = render_directory_listing(info->path, urlpath, &info->size);
+        if (info->fd < 0 && fd_exhausted(errno) && file_cache_release_fds())
+            info->fd = render_directory_listing(info->path, urlpath, &info->size);
+        if (info->fd < 0) {
+            fileinfo_set_error(info, errno);
+            return info;
+        }
+        mime_table_release(info->mime);
+        info->mime = NULL;
+        info->content_type = LISTING_CONTENT_TYPE;
+    } else {
+        // regular fileか確認
+        if (!S_ISREG(st.st_mode)) return info;
+        info->fd = open(info->path, O_RDONLY | O_CLOEXEC);
+        if (info->fd < 0 && fd_exhausted(errno) && file_cache_release_fds())
+            info->fd = open(info->path, O_RDONLY | O_CLOEXEC);
+        if (info->fd < 0) {
+            fileinfo_set_error(info, errno);
+            return info;
+        }
+        info->size = st.st_size;
+    }
+    info->ok = 1;
+    // 検証子 (validator) もファイルが変わらない限り同じなので作っておく
+    // ETagはinode・サイズ・更新時刻から作る、中身を読んでハッシュを取るほどの手間はかけない
+    if (asprintf(&info->etag, "\"%lx-%lx-%lx.%lx\"", (unsigned long)info->ino, info->size,
+                 (unsigned long)info->mtime, info->mtime_nsec) < 0)
+        log_exit("failed to allocate memory");
+    if (!gmtime_r(&info->mtime, &tm)) log_exit("gmtime_r() failed: %s", strerror(errno));
+    strftime(info->last_modified, sizeof info->last_modified, HTTP_DATE_FORMAT, &tm);
+    // その場で圧縮したものは別の内容なので、ETagも別にする
+    if (asprintf(&info->gzip_etag, "%.*s-gzip\"", (int)strlen(info->etag) - 1, info->etag) < 0)
+        log_exit("failed to allocate memory");
+    if (asprintf(&info->header, "Content-Length: %ld\r\nContent-Type: %s\r\n%s%s%s%sLast-Modified: %s\r\nETag: %s\r\n",
+                 info->size, guess_content_type(info),
+                 encoding != ENC_IDENTITY ? "Content-Encoding: " : "",
+                 encoding != ENC_IDENTITY ? encoding_names[encoding] : "",
+                 encoding != ENC_IDENTITY ? "\r\n" : "",
+                 negotiates_encoding() ? "Vary: Accept-Encoding\r\n" : "",
+                 info->last_modified, info->etag) < 0)
+        log_exit("failed to allocate memory");
+    return info;
+}
+
+// キャッシュしているファイル情報がまだ有効か、TTLが切れていればlstat(2)して確かめる
+static int fileinfo_is_fresh(struct FileInfo *info, time_t now) {
+    struct stat st;
+
+    if (now - info->checked_at < file_cache_ttl) return 1;
+    if (lstat(info->path, &st) < 0) {
+        // 存在しないことをキャッシュしていた場合は、まだ存在しなければ有効
+        if (info->ok) return 0;
+        info->checked_at = now;
+        return 1;
+    }
+    // 一覧はエントリの追加・削除・改名でディレクトリのmtimeが変わったら作り直す
+    if (info->is_dir) {
+        if (!S_ISDIR(st.st_mode) || st.st_ino != info->ino ||
+            st.st_mtim.tv_sec != info->mtime || st.st_mtim.tv_nsec != info->mtime_nsec)
+            return 0;
+        info->checked_at = now;
+        return 1;
+    }
+    if (!info->ok || !S_ISREG(st.st_mode)) return 0;
+    if (st.st_ino != info->ino || st.st_size != info->size ||
+        st.st_mtim.tv_sec != info->mtime || st.st_mtim.tv_nsec != info->mtime_nsec)
+        return 0;
+    info->checked_at = now;
+    return 1;
+}
+
+// 返したFileInfoは使い終わったらfree_fileinfo()で返却する
+// encodingを指定すると圧縮済みの兄弟のファイルを探す、同じURLのものは同じバケットに入る
+static struct FileInfo *lookup_fileinfo(char *docroot, char *urlpath, enum ContentEncoding encoding) {
+    struct FileInfo *info, *victim;
+    time_t now;
+    size_t bucket;
+
+    if (file_cache_entries == 0) {
+        STAT_ADD(file_cache_misses, 1);
+        return load_fileinfo(docroot, urlpath, encoding);
+    }
+
+    now = time(NULL);
+    bucket = hash_string(urlpath) & (file_cache.nbuckets - 1);
+    pthread_mutex_lock(&file_cache.lock);
+    for (info = file_cache.buckets[bucket]; info; info = info->hash_next) {
+        if (info->encoding == encoding && strcmp(info->urlpath, urlpath) == 0) break;
+    }
+    if (info) {
+        if (fileinfo_is_fresh(info, now)) {
+            lru_unlink(info);
+            lru_push_front(info);
+            info->refcnt++;
+            pthread_mutex_unlock(&file_cache.lock);
+            STAT_ADD(file_cache_hits, 1);
+            return info;
+        }
+        file_cache_remove(info);
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    STAT_ADD(file_cache_misses, 1);
+
+    // lstat(2)やopen(2)の間は他のスレッドを止めないようにロックを外しておく
+    info = load_fileinfo(docroot, urlpath, encoding);
+    if (info->transient) return info;
+
+    pthread_mutex_lock(&file_cache.lock);
+    // 同時に同じパスを読み込んだスレッドがいても、後から登録したほうが先頭に来るだけで害はない
+    info->hash_next = file_cache.buckets[bucket];
+    file_cache.buckets[bucket] = info;
+    lru_push_front(info);
+    info->refcnt++;     // キャッシュ自身が持つ参照
+    file_cache.count++;
+    while (file_cache.count > file_cache_entries) {
+        victim = file_cache.lru_tail;
+        file_cache_remove(victim);
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return info;
+}
+
+static struct FileInfo *get_fileinfo(char *docroot, char *urlpath, enum ContentEncoding encoding) {
+    struct FileInfo *info;
+    long started = now_usec();
+
+    info = lookup_fileinfo(docroot, urlpath, encoding);
+    stats_record_latency(LAT_OPEN, now_usec() - started);
+    return info;
+}
+
+// URLが指すファイル、ディレクトリならDIRECTORY_INDEXがあればそれ、無ければ一覧
+static struct FileInfo *get_document(char *docroot, char *urlpath) {
+    struct FileInfo *info;
+    char *index;
+
+    if (has_trailing_slash(urlpath)) {
+        if (asprintf(&index, "%s%s", urlpath, DIRECTORY_INDEX) < 0)
+            log_exit("failed to allocate memory");
+        info = get_fileinfo(docroot, index, ENC_IDENTITY);
+        free(index);
+        // 一時的なエラーで開けなかったときは、一覧で代わりにせず500にする
+        if (info->ok || info->transient) return info;
+        free_fileinfo(info);
+    }
+    return get_fileinfo(docroot, urlpath, ENC_IDENTITY);
+}
+
+/*
+ * レスポンスヘッダの組み立て
+ *
+ * stdioを通さず、ヘッダの断片をiovecに並べておき、送るときに1回のsendmsg(2)でまとめて書き出す。
+ * 起動時に作っておいた文字列やFileInfoのヘッダのように、送り終えるまで変わらないものは
+ * コピーせずにそのまま指す。書式付きで作る部分だけbufに書き、続けて書いた分は1つのiovecにまとめる。
+ * iovecやbufが足りなくなったらfailedを立てて-1を返す。組み立てる関数はそのまま続けてよく、
+ * build_response()が最後にまとめて調べて500に差し替える (その接続だけで済ませ、プロセスは止めない)。
+ */
+#define RESPONSE_IOV_MAX 16
+#define RESPONSE_BUF_SIZE 1024
+
+struct ResponseHeader {
+    struct iovec iov[RESPONSE_IOV_MAX];
+    int iovcnt;
+    int iov_pos;        // 送信済みのiovec (送りかけのものは先頭をずらしてある)
+    char buf[RESPONSE_BUF_SIZE];
+    size_t used;
+    int status;         // ステータスコード、統計に使う
+    int failed;         // 組み立てられなかった (iovecかbufが足りない、ボディのメモリが確保できない)
+};
+
+static void header_init(struct ResponseHeader *out) {
+    out->iovcnt = 0;
+    out->iov_pos = 0;
+    out->used = 0;
+    out->status = 0;
+    out->failed = 0;
+}
+
+// 送り終えるまで変わらない文字列を、コピーせずに追加する
+static int header_add_ref(struct ResponseHeader *out, const char *p, size_t len) {
+    if (len == 0) return 0;
+    if (out->iovcnt == RESPONSE_IOV_MAX) {
+        out->failed = 1;
+        return -1;
+    }
+    out->iov[out->iovcnt].iov_base = (char *)p;
+    out->iov[out->iovcnt].iov_len = len;
+    out->iovcnt++;
+    return 0;
+}
+
+// bufに書いた分をiovecに加える、直前もbufに書いていたら同じiovecを伸ばす
+static int header_commit(struct ResponseHeader *out, size_t len) {
+    struct iovec *last = out->iovcnt > 0 ? &out->iov[out->iovcnt - 1] : NULL;
+
+    if (last && (char *)last->iov_base + last->iov_len == out->buf + out->used)
+        last->iov_len += len;
+    else if (header_add_ref(out, out->buf + out->used, len) < 0)
+        return -1;
+    out->used += len;
+    return 0;
+}
+
+// すぐに変わってしまう文字列をbufにコピーして追加する
+static int header_append(struct ResponseHeader *out, const char *p, size_t len) {
+    if (out->used + len > RESPONSE_BUF_SIZE) {
+        out->failed = 1;
+        return -1;
+    }
+    memcpy(out->buf + out->used, p, len);
+    return header_commit(out, len);
+}
+
+static int header_printf(struct ResponseHeader *out, const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(out->buf + out->used, RESPONSE_BUF_SIZE - out->used, fmt, ap);
+    va_end(ap);
+    if (len < 0 || out->used + len >= RESPONSE_BUF_SIZE) {
+        out->failed = 1;
+        return -1;
+    }
+    return header_commit(out, len);
+}
+
+/*
+ * 全レスポンスに付けるDate・Server・Connectionのヘッダ
+ *
+ * Dateは秒単位なので、同じ秒の間は前に作ったものを使い回す。
+ * Connectionの値ごとに1つずつ、ヘッダの塊をまるごと作っておいてそのまま書き出す。
+ * スレッドごとに持つのでロックは要らない。
+ */
+#define COMMON_HEADER_SIZE 128
+
+struct CommonHeader {
+    time_t t;       // 作ったときの時刻
+    char block[2][COMMON_HEADER_SIZE];  // [keep_alive]
+    int len[2];
+};
+
+static __thread struct CommonHeader common_header;    // t が0なので最初の呼び出しで作られる
+
+static void refresh_common_header(time_t now) {
+    struct tm tm;
+    char date[64];
+    int keep_alive;
+
+    // スレッドから呼ばれても安全なようにgmtime_r(3)を使う
+    if (!gmtime_r(&now, &tm)) log_exit("gmtime_r() failed: %s", strerror(errno));
+    strftime(date, sizeof date, HTTP_DATE_FORMAT, &tm);
+    for (keep_alive = 0; keep_alive <= 1; keep_alive++) {
+        common_header.len[keep_alive] = snprintf(common_header.block[keep_alive], COMMON_HEADER_SIZE,
+            "Date: %s\r\nServer: %s/%s\r\nConnection: %s\r\n",
+            date, SERVER_NAME, SERVER_VERSION, keep_alive ? "keep-alive" : "close");
+    }
+    common_header.t = now;
+}
+
+static void output_common_header_fields(struct HTTPRequest *req, struct ResponseHeader *out, char *status) {
+    time_t now;
+    int keep_alive = req->keep_alive ? 1 : 0;
+
+    now = time(NULL);
+    if (now != common_header.t) refresh_common_header(now);
+    out->status = atoi(status);
+    header_printf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
+    // 送り終える前に秒が変わると作り直されるのでコピーする
+    header_append(out, common_header.block[keep_alive], common_header.len[keep_alive]);
+}
+
+/*
+ * エラーページ
+ *
+ * ボディは固定の文字列なので、Content-Length・Content-Type・空行・ボディを起動時に1つの塊にしておき
+ * レスポンスごとには組み立てない。
+ * keep-aliveでは接続を閉じてボディの終わりを示せないので、エラーページにも長さが必要
+ */
+enum ErrorPageId {
+    PAGE_NOT_FOUND,
+    PAGE_METHOD_NOT_ALLOWED,
+    PAGE_NOT_IMPLEMENTED,
+    PAGE_RANGE_NOT_SATISFIABLE,
+    PAGE_BAD_REQUEST,
+    PAGE_PAYLOAD_TOO_LARGE,
+    PAGE_HEADER_TOO_LARGE,
+    PAGE_MOVED_PERMANENTLY,
+    PAGE_INTERNAL_SERVER_ERROR,
+    NUM_ERROR_PAGES,
+};
+
+struct ErrorPage {
+    char *status;
+    char *html;
+    char *block;        // 起動時に作る
+    size_t header_len;  // HEADのときはここまでだけ送る
+    size_t len;
+};
+
+static struct ErrorPage error_pages[NUM_ERROR_PAGES] = {
+    [PAGE_NOT_FOUND] = { "404 Not Found",
+        "<html>\r\n"
+        "<header><title>Not Found</title><header>\r\n"
+        "<body><p>File not found</p></body>\r\n"
+        "</html>\r\n" },
+    [PAGE_METHOD_NOT_ALLOWED] = { "405 Method Not Allowed",
+        "<html>\r\n"
+        "<header>\r\n"
+        "<title>405 Method Not Allowed</title>\r\n"
+        "<header>\r\n"
+        "<body>\r\n"
+        "<p>The request method is not allowed</p>\r\n"
+        "</body>\r\n"
+        "</html>\r\n" },
+    [PAGE_NOT_IMPLEMENTED] = { "501 Not Implemented",
+        "<html>\r\n"
+        "<header>\r\n"
+        "<title>501 Not Implemented</title>\r\n"
+        "<header>\r\n"
+        "<body>\r\n"
+        "<p>The request method is not implemented</p>\r\n"
+        "</body>\r\n"
+        "</html>\r\n" },
+    [PAGE_RANGE_NOT_SATISFIABLE] = { "416 Range Not Satisfiable",
+        "<html>\r\n"
+        "<header><title>Range Not Satisfiable</title><header>\r\n"
+        "<body><p>Requested range not satisfiable</p></body>\r\n"
+        "</html>\r\n" },
+    [PAGE_BAD_REQUEST] = { "400 Bad Request",
+        "<html>\r\n"
+        "<header><title>Bad Request</title><header>\r\n"
+        "<body><p>Your request could not be understood</p></body>\r\n"
+        "</html>\r\n" },
+    [PAGE_PAYLOAD_TOO_LARGE] = { "413 Payload Too Large",
+        "<html>\r\n"
+        "<header><title>Payload Too Large</title><header>\r\n"
+        "<body><p>Request body too large</p></body>\r\n"
+        "</html>\r\n" },
+    [PAGE_HEADER_TOO_LARGE] = { "431 Request Header Fields Too Large",
+        "<html>\r\n"
+        "<header><title>Request Header Fields Too Large</title><header>\r\n"
+        "<body><p>Request header too large</p></body>\r\n"
+        "</html>\r\n" },
+    [PAGE_MOVED_PERMANENTLY] = { "301 Moved Permanently",
+        "<html>\r\n"
+        "<header><title>Moved Permanently</title><header>\r\n"
+        "<body><p>The document has moved</p></body>\r\n"
+        "</html>\r\n" },
+    [PAGE_INTERNAL_SERVER_ERROR] = { "500 Internal Server Error",
+        "<html>\r\n"
+        "<header><title>Internal Server Error</title><header>\r\n"
+        "<body><p>The server could not build the response</p></body>\r\n"
+        "</html>\r\n" },
+};
+
+static void error_pages_init(void) {
+    struct ErrorPage *page;
+    int len;
+
+    for (page = error_pages; page < error_pages + NUM_ERROR_PAGES; page++) {
+        len = asprintf(&page->block, "Content-Length: %zu\r\nContent-Type: text/html\r\n\r\n%s",
+                       strlen(page->html), page->html);
+        if (len < 0) log_exit("failed to allocate memory");
+        page->len = len;
+        page->header_len = len - strlen(page->html);
+    }
+}
+
+// ステータス行と共通ヘッダの後にエラーページを付ける、間に独自のヘッダを入れる場合は分けて呼ぶ
+static void output_error_page_body(struct HTTPRequest *req, struct ResponseHeader *out, enum ErrorPageId id) {
+    struct ErrorPage *page = &error_pages[id];
+
+    header_add_ref(out, page->block, slice_equals(req->method, "HEAD") ? page->header_len : page->len);
+}
+
+static void output_error_page(struct HTTPRequest *req, struct ResponseHeader *out, enum ErrorPageId id) {
+    output_common_header_fields(req, out, error_pages[id].status);
+    output_error_page_body(req, out, id);
+}
+
+/*
+ * 小さいファイルのレスポンスキャッシュ
+ *
+ * response_cache_max_object以下のファイルについて、Content-Length・Content-Typeのヘッダと
+ * ボディを1つの連続したバッファにしておく。ヒットすればステータス行などの共通ヘッダと
+ * このバッファの2つを1回のsendmsg(2)で送るだけで済み、ファイルを読む必要もない。
+ * 合計サイズがresponse_cache_sizeを超えたら最も古く使われたものから捨てる。
+ * 共通ヘッダ (DateとConnection) はレスポンスごとに変わるのでキャッシュしない。
+ */
+struct CachedResponse {
+    char *key;          // URLのパス
+    enum ContentEncoding encoding;  // ボディの圧縮形式、同じURLでも別のエントリになる
+    char *data;         // ヘッダの残り + 空行 + ボディ
+    size_t len;
+    size_t header_len;  // HEADのときはここまでだけ送る
+    ino_t ino;          // 作ったときのファイル、FileInfoと比べて古くなっていないか確かめる
+    long size;
+    time_t mtime;
+    long mtime_nsec;
+    int refcnt;         // キャッシュ自身と送信中のレスポンスからの参照
+    struct CachedResponse *hash_next;
+    struct CachedResponse *lru_prev, *lru_next;
+};
+
+struct ResponseCache {
+    pthread_mutex_t lock;
+    struct CachedResponse **buckets;
+    size_t nbuckets;
+    size_t used;        // 使用中のバイト数
+    struct CachedResponse *lru_head, *lru_tail;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+static struct ResponseCache response_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, NULL, 0, 0, 0 };
+
+#define RESPONSE_CACHE_BUCKETS 4096
+
+static void response_cache_init(void) {
+    if (response_cache_size == 0) return;
+    response_cache.nbuckets = RESPONSE_CACHE_BUCKETS;
+    response_cache.buckets = xmalloc(sizeof(struct CachedResponse *) * RESPONSE_CACHE_BUCKETS);
+    memset(response_cache.buckets, 0, sizeof(struct CachedResponse *) * RESPONSE_CACHE_BUCKETS);
+}
+
+static void destroy_cached_response(struct CachedResponse *cr) {
+    free(cr->key);
+    free(cr->data);
+    free(cr);
+}
+
+static void release_cached_response(struct CachedResponse *cr) {
+    int destroy;
+
+    pthread_mutex_lock(&response_cache.lock);
+    destroy = (--cr->refcnt == 0);
+    pthread_mutex_unlock(&response_cache.lock);
+    if (destroy) destroy_cached_response(cr);
+}
+
+static void response_lru_unlink(struct CachedResponse *cr) {
+    if (cr->lru_prev) cr->lru_prev->lru_next = cr->lru_next;
+    else response_cache.lru_head = cr->lru_next;
+    if (cr->lru_next) cr->lru_next->lru_prev = cr->lru_prev;
+    else response_cache.lru_tail = cr->lru_prev;
+}
+
+static void response_lru_push_front(struct CachedResponse *cr) {
+    cr->lru_prev = NULL;
+    cr->lru_next = response_cache.lru_head;
+    if (response_cache.lru_head) response_cache.lru_head->lru_prev = cr;
+    else response_cache.lru_tail = cr;
+    response_cache.lru_head = cr;
+}
+
+// response_cache.lockを取った状態で呼ぶ
+static void response_cache_remove(struct CachedResponse *cr) {
+    struct CachedResponse **p;
+
+    p = &response_cache.buckets[hash_string(cr->key) & (response_cache.nbuckets - 1)];
+    while (*p != cr) p = &(*p)->hash_next;
+    *p = cr->hash_next;
+    response_lru_unlink(cr);
+    response_cache.used -= cr->len;
+    STAT_ADD(response_cache_bytes, -(long)cr->len);
+    if (--cr->refcnt == 0) destroy_cached_response(cr);
+}
+
+// SIGHUPで全部捨てる、送信中のものは最後のrelease_cached_response()で解放される
+static void response_cache_flush(void) {
+    pthread_mutex_lock(&response_cache.lock);
+    while (response_cache.lru_tail)
+        response_cache_remove(response_cache.lru_tail);
+    pthread_mutex_unlock(&response_cache.lock);
+}
+
+static int cached_response_matches(struct CachedResponse *cr, struct FileInfo *info) {
+    return cr->ino == info->ino && cr->size == info->size &&
+        cr->mtime == info->mtime && cr->mtime_nsec == info->mtime_nsec;
+}
+
+static struct CachedResponse *new_cached_response(struct FileInfo *info, enum ContentEncoding encoding) {
+    struct CachedResponse *cr;
+
+    cr = xmalloc(sizeof(struct CachedResponse));
+    memset(cr, 0, sizeof(struct CachedResponse));
+    cr->key = strdup(info->urlpath);
+    if (!cr->key) log_exit("failed to allocate memory");
+    cr->encoding = encoding;
+    cr->ino = info->ino;
+    cr->size = info->size;
+    cr->mtime = info->mtime;
+    cr->mtime_nsec = info->mtime_nsec;
+    cr->refcnt = 1;
+    return cr;
+}
+
+#ifdef USE_ZLIB
+// len バイトをgzip形式で圧縮する、失敗したらNULLを返す
+static char *gzip_compress(const char *buf, size_t len, size_t *outlen) {
+    z_stream zs;
+    char *out;
+    size_t cap;
+
+    memset(&zs, 0, sizeof(zs));
+    // windowBitsに16を足すとzlib形式ではなくgzip形式で出力する
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    // 出力が収まる大きさを先に確保しておけば1回のdeflate()で終わる
+    cap = deflateBound(&zs, len);
+    out = xmalloc(cap);
+    zs.next_in = (Bytef *)buf;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *outlen = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+// ファイルを読み込み、gzipで圧縮したレスポンスのバッファを作る
+static struct CachedResponse *build_gzip_response(struct FileInfo *info) {
+    struct CachedResponse *cr;
+    char *plain, *compressed, *header;
+    size_t compressed_len;
+    int header_len;
+    ssize_t n;
+
+    plain = xmalloc(info->size);
+    n = pread(info->fd, plain, info->size, 0);
+    if (n != info->size) {
+        free(plain);
+        return NULL;
+    }
+    compressed = gzip_compress(plain, info->size, &compressed_len);
+    free(plain);
+    if (!compressed) return NULL;
+    header_len = asprintf(&header,
+        "Content-Length: %zu\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\n"
+        "Vary: Accept-Encoding\r\nLast-Modified: %s\r\nETag: %s\r\n\r\n",
+        compressed_len, guess_content_type(info), info->last_modified, info->gzip_etag);
+    if (header_len < 0) log_exit("failed to allocate memory");
+
+    cr = new_cached_response(info, ENC_GZIP);
+    cr->header_len = header_len;
+    cr->len = header_len + compressed_len;
+    cr->data = xmalloc(cr->len);
+    memcpy(cr->data, header, header_len);
+    memcpy(cr->data + header_len, compressed, compressed_len);
+    free(header);
+    free(compressed);
+    return cr;
+}
+#endif
+
+// ファイルを読み込んでレスポンスのバッファを作る
+// encodingがinfoと違う場合はその場で圧縮する
+static struct CachedResponse *build_cached_response(struct FileInfo *info, enum ContentEncoding encoding) {
+    struct CachedResponse *cr;
+    size_t header_len;
+    ssize_t n;
+
+    if (encoding != info->encoding) {
+#ifdef USE_ZLIB
+        if (encoding == ENC_GZIP && info->encoding == ENC_IDENTITY)
+            return build_gzip_response(info);
+#endif
+        return NULL;
+    }
+    header_len = strlen(info->header) + 2;
+    cr = new_cached_response(info, encoding);
+    cr->len = header_len + info->size;
+    cr->header_len = header_len;
+    cr->data = xmalloc(cr->len);
+    memcpy(cr->data, info->header, header_len - 2);
+    memcpy(cr->data + header_len - 2, "\r\n", 2);
+    n = pread(info->fd, cr->data + header_len, info->size, 0);
+    // 読んでいる間にファイルが変わった場合はキャッシュしない
+    if (n != info->size) {
+        destroy_cached_response(cr);
+        return NULL;
+    }
+    return cr;
+}
+
+// キャッシュ済みのレスポンスを探し、無ければ作って登録する
+// キャッシュの対象外ならNULLを返す、返したものは使い終わったらrelease_cached_response()する
+// encodingはボディの圧縮形式、infoと違う場合はその場で圧縮したものを返す
+static struct CachedResponse *response_cache_get(struct FileInfo *info, enum ContentEncoding encoding) {
+    struct CachedResponse *cr;
+    size_t bucket;
+
+    if (response_cache_size == 0 || info->size > response_cache_max_object)
+        return NULL;
+
+    bucket = hash_string(info->urlpath) & (response_cache.nbuckets - 1);
+    pthread_mutex_lock(&response_cache.lock);
+    for (cr = response_cache.buckets[bucket]; cr; cr = cr->hash_next) {
+        if (cr->encoding == encoding && strcmp(cr->key, info->urlpath) == 0) break;
+    }
+    if (cr && cached_response_matches(cr, info)) {
+        response_lru_unlink(cr);
+        response_lru_push_front(cr);
+        cr->refcnt++;
+        response_cache.hits++;
+        STAT_ADD(response_cache_hits, 1);
+        pthread_mutex_unlock(&response_cache.lock);
+        return cr;
+    }
+    // ファイルが変わっていたら古いものは捨てる
+    if (cr) response_cache_remove(cr);
+    response_cache.misses++;
+    STAT_ADD(response_cache_misses, 1);
+    pthread_mutex_unlock(&response_cache.lock);
+
+    cr = build_cached_response(info, encoding);
+    if (!cr) return NULL;
+    if (cr->len > response_cache_size) return cr;   // 入りきらないので今回だけ使う
+
+    pthread_mutex_lock(&response_cache.lock);
+    while (response_cache.used + cr->len > response_cache_size) {
+        response_cache_remove(response_cache.lru_tail);
+        response_cache.evictions++;
+        STAT_ADD(response_cache_evictions, 1);
+    }
+    cr->hash_next = response_cache.buckets[bucket];
+    response_cache.buckets[bucket] = cr;
+    response_lru_push_front(cr);
+    response_cache.used += cr->len;
+    STAT_ADD(response_cache_bytes, cr->len);
+    cr->refcnt++;
+    pthread_mutex_unlock(&response_cache.lock);
+    return cr;
+}
+
+static void log_response_cache_stats(void) {
+    pthread_mutex_lock(&response_cache.lock);
+    log_message(LOG_INFO, "response cache: used %zu/%zu bytes, %lu hits, %lu misses, %lu evictions",
+                response_cache.used, response_cache_size,
+                response_cache.hits, response_cache.misses, response_cache.evictions);
+    pthread_mutex_unlock(&response_cache.lock);
+}
+
+// SIGUSR1を受け取っていれば統計をログに出す
+// ブロッキングのワーカーはaccept(2)が再開されるので、次のリクエストの後に出す
+static void check_stats_request(void) {
+    if (!stats_requested) return;
+    stats_requested = 0;
+    log_response_cache_stats();
+}
+
+// ヘッダの後に送るデータ
+// キャッシュ済みのレスポンス (メモリ上) か、ファイルの指定範囲のどちらか
+// ファイルの範囲はヘッダを書き出したあと、sendfile(2)でページキャッシュから直接ソケットへ送る
+struct ResponseBody {
+    struct CachedResponse *cached;
+    const char *data;   // 未送信のデータ
+    size_t data_len;
+    // ファイルのfdはinfoが開いているものを借りる
+    // sendfile(2)はoffsetを自分で持つので、同じfdを複数の接続で同時に使っても問題ない
+    int fd;             // -1ならファイル無し
+    off_t offset;
+    off_t length;
+    struct FileInfo *info;
+    // multipart/byteranges ではパートごとに区切り (メモリ) とファイルの一部を交互に送る
+    // 上のdata・offset・lengthに最初のパートを入れ、送り終えたら次のパートを詰め直す
+    struct BodyPart *parts;
+    int nparts;
+    int next_part;      // 次に詰めるパート
+    char *parts_buf;    // 全パートの区切りをまとめたもの
+    char *data_buf;     // レスポンスごとに作ったボディ (統計のページ)、dataはこれを指す
+};
+
+// レスポンスごとに作るボディ (multipartの区切りや統計のページ) を書くバッファ
+// 足りなくなったら伸ばす。確保できなければfailedを立て、呼び出し側で500に差し替えてもらう
+#define BODY_BUILDER_INITIAL_SIZE 1024
+
+struct BodyBuilder {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+static void body_printf(struct BodyBuilder *b, const char *fmt, ...) {
+    va_list ap;
+    size_t cap;
+    char *buf;
+    int n;
+
+    if (b->failed) return;
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->buf + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            b->failed = 1;
+            return;
+        }
+        if ((size_t)n < b->cap - b->len) break;
+        cap = b->cap ? b->cap * 2 : BODY_BUILDER_INITIAL_SIZE;
+        while (cap <= b->len + n) cap *= 2;
+        buf = realloc(b->buf, cap);
+        if (!buf) {
+            b->failed = 1;
+            return;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+    b->len += n;
+}
+
+struct BodyPart {
+    size_t prefix_off;  // parts_buf内の区切りとパートのヘッダ
+    size_t prefix_len;
+    off_t offset;       // ファイルの範囲
+    off_t length;
+};
+
+static void finish_response_body(struct ResponseBody *body) {
+    if (body->cached) release_cached_response(body->cached);
+    if (body->info) free_fileinfo(body->info);
+    free(body->parts);
+    free(body->parts_buf);
+    free(body->data_buf);
+    memset(body, 0, sizeof(struct ResponseBody));
+    body->fd = -1;
+}
+
+// 次のパートを送る準備をする、もう無ければ0を返す
+static int next_body_part(struct ResponseBody *body) {
+    struct BodyPart *part;
+
+    if (body->next_part >= body->nparts) return 0;
+    part = &body->parts[body->next_part++];
+    body->data = body->parts_buf + part->prefix_off;
+    body->data_len = part->prefix_len;
+    body->offset = part->offset;
+    body->length = part->length;
+    return 1;
+}
+
+// If-None-Matchのリストにetagが含まれているか
+// 比較は弱い比較 (W/の有無は無視する) でよい (RFC 7232 3.2)
+static int etag_list_matches(char *list, char *etag) {
+    size_t len = strlen(etag);
+    char *p = list;
+
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') return 0;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (strncmp(p, etag, len) == 0 && strchr(" \t,", p[len])) return 1;
+        // 次の要素へ、ETagの中にはカンマを含められないのでカンマまで読み飛ばせばよい
+        p += strcspn(p, ",");
+    }
+}
+
+// Accept-Encodingでcodingを受け付けているか
+// gzip;q=0 のようにqが0なら受け付けない、*は明示されていないもの全部に当てはまる
+static int accepts_encoding(struct HTTPRequest *req, const char *coding) {
+    char *val, *p, *end;
+    size_t len = strlen(coding), item_len;
+    int matched, star = 0, rejected;
+
+    val = known_header_value(req, HDR_ACCEPT_ENCODING);
+    if (!val) return 0;
+    p = val;
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') break;
+        item_len = strcspn(p, " \t;,");
+        matched = item_len == len && strncasecmp(p, coding, len) == 0;
+        if (item_len == 1 && *p == '*') matched = 2;
+        p += item_len;
+        // ;q=0.5 などのパラメータ
+        rejected = 0;
+        while (*p != '\0' && *p != ',') {
+            p += strspn(p, " \t;");
+            if (strncasecmp(p, "q=", 2) == 0) {
+                rejected = strtod(p + 2, &end) <= 0;
+                p = end > p + 2 ? end : p + 2;
+            } else {
+                p += strcspn(p, ";,");
+            }
+        }
+        if (matched == 1) return !rejected;
+        if (matched == 2) star = rejected ? -1 : 1;
+    }
+    return star > 0;
+}
+
+// その場で圧縮する価値のあるテキストか
+static int is_compressible(struct FileInfo *info) {
+    const char *type = guess_content_type(info);
+
+    return strncmp(type, "text/", 5) == 0 ||
+        strcmp(type, "application/javascript") == 0 ||
+        strcmp(type, "application/json") == 0 ||
+        strcmp(type, "application/xml") == 0 ||
+        strcmp(type, "image/svg+xml") == 0;
+}
+
+// 返すボディの圧縮形式に合ったETag
+static char *representation_etag(struct FileInfo *info, enum ContentEncoding encoding) {
+    return encoding == info->encoding ? info->etag : info->gzip_etag;
+}
+
+// キャッシュしているクライアントの持っているものが最新なら304を返してよい
+static int is_not_modified(struct HTTPRequest *req, struct FileInfo *info, enum ContentEncoding encoding) {
+    char *val;
+    struct tm tm;
+    char *end;
+    time_t since;
+
+    // 両方ある場合はIf-None-Matchを優先し、If-Modified-Sinceは見ない (RFC 7232 6)
+    val = lookup_header_field_value(req, "If-None-Match");
+    if (val) return etag_list_matches(val, representation_etag(info, encoding));
+
+    val = known_header_value(req, HDR_IF_MODIFIED_SINCE);
+    if (!val) return 0;
+    memset(&tm, 0, sizeof tm);
+    end = strptime(val, HTTP_DATE_FORMAT, &tm);
+    // 解釈できない日付は無視する
+    if (!end || *end != '\0') return 0;
+    since = timegm(&tm);
+    // Last-Modifiedは秒単位なので秒で比べる
+    return info->mtime <= since;
+}
+
+
+/*
+ * Rangeリクエスト
+ *
+ * 範囲は1つならそのまま206で、複数ならmultipart/byteranges で返す。
+ * どちらもファイルの中身はメモリに載せず、範囲ごとにoffsetを指定してsendfile(2)で送る。
+ */
+#define MAX_RANGES 16
+
+struct ByteRange {
+    off_t first;
+    off_t last;     // 末尾を含む
+};
+
+// parse_range()の戻り値
+enum {
+    RANGE_NONE = 0,         // Rangeを無視してファイル全体を返す
+    RANGE_UNSATISFIABLE = -1,
+};
+
+// Range: bytes=0-99,200-,-50 を解析して範囲の数を返す
+// 書式が正しくない・範囲が多すぎる場合は無視してよい (RFC 7233 3.1)
+static int parse_range(char *val, off_t size, struct ByteRange *ranges) {
+    char *p, *end;
+    long long first, last;
+    int n = 0, nspecs = 0;
+
+    if (strncasecmp(val, "bytes=", strlen("bytes=")) != 0) return RANGE_NONE;
+    p = val + strlen("bytes=");
+    for (;;) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') break;
+        if (++nspecs > MAX_RANGES) return RANGE_NONE;
+        if (*p == '-') {
+            // -500: 末尾の500バイト
+            last = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || last < 0) return RANGE_NONE;
+            if (last == 0 || size == 0) goto next;
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        } else {
+            if (!isdigit((unsigned char)*p)) return RANGE_NONE;
+            first = strtoll(p, &end, 10);
+            if (*end != '-') return RANGE_NONE;
+            p = end + 1;
+            if (isdigit((unsigned char)*p)) {
+                last = strtoll(p, &end, 10);
+                if (last < first) return RANGE_NONE;
+            } else {
+                // 500-: 500バイト目から最後まで
+                last = size - 1;
+                end = p;
+            }
+            // ファイルより後ろを指す範囲は満たせないので除く
+            if (first >= size) goto next;
+            if (last >= size) last = size - 1;
+        }
+        ranges[n].first = first;
+        ranges[n].last = last;
+        n++;
+    next:
+        p = end + strspn(end, " \t");
+        if (*p != '\0' && *p != ',') return RANGE_NONE;
+    }
+    if (nspecs == 0) return RANGE_NONE;
+    return n > 0 ? n : RANGE_UNSATISFIABLE;
+}
+
+// If-Rangeがあれば、クライアントの持っている版と今のファイルが同じときだけRangeに従う
+static int if_range_matches(struct HTTPRequest *req, struct FileInfo *info) {
+    char *val;
+
+    val = lookup_header_field_value(req, "If-Range");
+    if (!val) return 1;
+    return strcmp(val, info->etag) == 0 || strcmp(val, info->last_modified) == 0;
+}
+
+static void range_not_satisfiable(struct HTTPRequest *req, struct ResponseHeader *out, struct FileInfo *info) {
+    output_common_header_fields(req, out, error_pages[PAGE_RANGE_NOT_SATISFIABLE].status);
+    header_printf(out, "Content-Range: bytes */%ld\r\n", info->size);
+    output_error_page_body(req, out, PAGE_RANGE_NOT_SATISFIABLE);
+}
+
+// 圧縮の有無と検証子のヘッダ
+static void output_representation_headers(struct ResponseHeader *out, struct FileInfo *info, enum ContentEncoding encoding) {
+    if (encoding != ENC_IDENTITY)
+        header_printf(out, "Content-Encoding: %s\r\n", encoding_names[encoding]);
+    if (negotiates_encoding())
+        header_printf(out, "Vary: Accept-Encoding\r\n");
+    header_printf(out, "Last-Modified: %s\r\nETag: %s\r\n",
+                  info->last_modified, representation_etag(info, encoding));
+}
+
+static void not_modified(struct HTTPRequest *req, struct ResponseHeader *out, struct FileInfo *info, enum ContentEncoding encoding) {
+    output_common_header_fields(req, out, "304 Not Modified");
+    // 304にはボディは付けないが、検証子は200のときと同じものを返す
+    output_representation_headers(out, info, encoding);
+    header_append(out, "\r\n", 2);
+}
+
+// multipart/byteranges の区切り文字列を作る、bufは17バイト以上
+// ファイルの中身と衝突しにくいよう、プロセスごと・レスポンスごとに違うものにする
+// getrandom(2)が使えなければ時刻とpidとカウンタから作る (予測されても衝突しにくければよい)
+static void make_boundary(char *buf, size_t len) {
+    static unsigned long counter = 0;
+    unsigned char rnd[8];
+    unsigned long long x;
+    struct timespec ts;
+    int i;
+
+    if (getrandom(rnd, sizeof rnd, GRND_NONBLOCK) != sizeof rnd) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        x = ((unsigned long long)ts.tv_sec * 1000000007ULL) ^ (unsigned long long)ts.tv_nsec
+            ^ ((unsigned long long)getpid() << 32) ^ __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < (int)sizeof rnd; i++)
+            rnd[i] = x >> (i * 8);
+    }
+    for (i = 0; i < (int)sizeof rnd; i++)
+        snprintf(buf + i * 2, len - i * 2, "%02x", rnd[i]);
+}
+
+// 206 Partial Content を返す、infoの参照はbodyに渡す
+static void do_range_response(struct HTTPRequest *req, struct ResponseHeader *out, struct FileInfo *info,
+                              struct ResponseBody *body, struct ByteRange *ranges, int n) {
+    struct BodyBuilder parts = { NULL, 0, 0, 0 };
+    char boundary[32];
+    off_t total;
+    int i;
+
+    output_common_header_fields(req, out, "206 Partial Content");
+    // 範囲は圧縮済みのファイルであればその圧縮されたバイト列に対するもの
+    output_representation_headers(out, info, info->encoding);
+    body->fd = info->fd;
+    body->info = info;
+    if (n == 1) {
+        header_printf(out, "Content-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n\r\n",
+                      guess_content_type(info), (long)ranges[0].first, (long)ranges[0].last, info->size,
+                      (long)(ranges[0].last - ranges[0].first + 1));
+        body->offset = ranges[0].first;
+        body->length = ranges[0].last - ranges[0].first + 1;
+        return;
+    }
+
+    // パートごとの区切りを先に全部作り、Content-Lengthを計算する
+    // 最後の区切りもファイルの範囲が空のパートとして扱う
+    make_boundary(boundary, sizeof boundary);
+    body->parts = malloc(sizeof(struct BodyPart) * (n + 1));
+    if (!body->parts) {
+        out->failed = 1;
+        return;
+    }
+    total = 0;
+    for (i = 0; i < n; i++) {
+        struct BodyPart *part = &body->parts[i];
+
+        part->prefix_off = parts.len;
+        body_printf(&parts, "%s--%s\r\n", i == 0 ? "" : "\r\n", boundary);
+        body_printf(&parts, "Content-Type: %s\r\n", guess_content_type(info));
+        body_printf(&parts, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                    (long)ranges[i].first, (long)ranges[i].last, info->size);
+        part->prefix_len = parts.len - part->prefix_off;
+        part->offset = ranges[i].first;
+        part->length = ranges[i].last - ranges[i].first + 1;
+        total += part->length;
+    }
+    body->parts[n].prefix_off = parts.len;
+    body_printf(&parts, "\r\n--%s--\r\n", boundary);
+    body->parts[n].prefix_len = parts.len - body->parts[n].prefix_off;
+    body->parts[n].offset = 0;
+    body->parts[n].length = 0;
+    body->nparts = n + 1;
+    // 失敗していてもfinish_response_body()で解放されるようにbodyに渡しておく
+    body->parts_buf = parts.buf;
+    if (parts.failed) {
+        out->failed = 1;
+        return;
+    }
+    total += parts.len;
+
+    header_printf(out, "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %ld\r\n\r\n",
+                  boundary, (long)total);
+    next_body_part(body);
+}
+
+static void do_file_response(struct HTTPRequest *req, struct ResponseHeader *out, char *docroot, struct ResponseBody *body) {
+    struct FileInfo *info, *variant;
+    struct CachedResponse *cr;
+    struct ByteRange ranges[MAX_RANGES];
+    enum ContentEncoding encoding;
+    char *range;
+    int n;
+
+    info = get_document(docroot, req->path.ptr);
+    if (!info->ok) {
+        if (info->transient) {
+            free_fileinfo(info);
+            output_error_page(req, out, PAGE_INTERNAL_SERVER_ERROR);
+            return;
+        }
+        // ディレクトリの中の相対リンクが正しく解決されるように、/で終わるURLへ移ってもらう
+        if (info->is_dir && !has_trailing_slash(req->path.ptr)) {
+            free_fileinfo(info);
+            output_common_header_fields(req, out, error_pages[PAGE_MOVED_PERMANENTLY].status);
+            // パスは長さに上限が無くbufに入りきらないことがあるので、送り終えるまで残っているリクエストを指す
+            header_add_ref(out, "Location: ", strlen("Location: "));
+            header_add_ref(out, req->path.ptr, req->path.len);
+            header_add_ref(out, "/\r\n", 3);
+            output_error_page_body(req, out, PAGE_MOVED_PERMANENTLY);
+            return;
+        }
+        free_fileinfo(info);
+        output_error_page(req, out, PAGE_NOT_FOUND);
+        return;
+    }
+    // 圧縮率の高いbrから順に、クライアントが受け付けて圧縮済みのファイルがあればそちらを送る
+    // DIRECTORY_INDEXを返す場合はそのファイルの兄弟を探す、一覧には圧縮済みのファイルは無い
+    if (precompressed && !info->is_dir) {
+        for (encoding = ENC_BR; encoding > ENC_IDENTITY; encoding--) {
+            if (!accepts_encoding(req, encoding_names[encoding])) continue;
+            variant = get_fileinfo(docroot, info->urlpath, encoding);
+            if (variant->ok) {
+                free_fileinfo(info);
+                info = variant;
+                break;
+            }
+            free_fileinfo(variant);
+        }
+    }
+    // 圧縮済みのファイルが無ければ、テキストはその場で圧縮したもの (キャッシュ済み) を送る
+    encoding = info->encoding;
+    if (gzip_on_the_fly && encoding == ENC_IDENTITY && response_cache_size > 0 &&
+        info->size >= GZIP_MIN_LENGTH && info->size <= response_cache_max_object &&
+        is_compressible(info) && accepts_encoding(req, "gzip"))
+        encoding = ENC_GZIP;
+
+    if (is_not_modified(req, info, encoding)) {
+        not_modified(req, out, info, encoding);
+        free_fileinfo(info);
+        return;
+    }
+    // HEADにはRangeを適用しない、その場で圧縮する場合も範囲は無視して全体を返す
+    range = known_header_value(req, HDR_RANGE);
+    if (range && slice_equals(req->method, "GET") && encoding == info->encoding && if_range_matches(req, info)) {
+        n = parse_range(range, info->size, ranges);
+        if (n == RANGE_UNSATISFIABLE) {
+            range_not_satisfiable(req, out, info);
+            free_fileinfo(info);
+            return;
+        }
+        if (n > 0) {
+            do_range_response(req, out, info, body, ranges, n);
+            return;
+        }
+    }
+    output_common_header_fields(req, out, "200 OK");
+    cr = response_cache_get(info, encoding);
+    // 圧縮に失敗した場合は圧縮せずに送る
+    if (!cr && encoding != info->encoding)
+        cr = response_cache_get(info, info->encoding);
+    if (cr) {
+        // 残りのヘッダとボディはキャッシュのバッファからそのまま送る
+        body->cached = cr;
+        body->data = cr->data;
+        body->data_len = slice_equals(req->method, "HEAD") ? cr->header_len : cr->len;
+        free_fileinfo(info);
+        return;
+    }
+    // Content-Lengthなどのヘッダは作っておいたものをコピーせずに使う
+    // 送り終えるまでinfoを手放さないように、HEADでもbodyに参照を持たせる
+    header_add_ref(out, info->header, strlen(info->header));
+    header_add_ref(out, "\r\n", 2);
+    body->info = info;
+    // ボディはここでは書かず、呼び出し側でヘッダの後にsendfile(2)で送ってもらう
+    if (!slice_equals(req->method, "HEAD") && info->size > 0) {
+        body->fd = info->fd;
+        body->offset = 0;
+        body->length = info->size;
+    }
+}
+
+// 全ワーカーのスロットを足し合わせる
+// 他のワーカーが書き込んでいる最中でも、カウンタ単位では壊れた値を読まない
+static void stats_sum(struct WorkerStats *sum) {
+    unsigned long *dst = (unsigned long *)sum;
+    size_t i, n = sizeof(struct WorkerStats) / sizeof(unsigned long);
+    int w;
+
+    // active_connectionsも含めて全フィールドがlongの大きさなので、まとめて足す
+    memset(sum, 0, sizeof(struct WorkerStats));
+    for (w = 0; w < stats_nslots; w++) {
+        unsigned long *src = (unsigned long *)&stats_slots[w];
+        for (i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void output_latency_histogram(struct BodyBuilder *f, const char *name, struct LatencyHistogram *h) {
+    unsigned long cumulative = 0;
+    int b;
+
+    body_printf(f, "# TYPE httpd2_%s_duration_seconds histogram\n", name);
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        cumulative += h->buckets[b];
+        body_printf(f, "httpd2_%s_duration_seconds_bucket{le=\"%.6f\"} %lu\n", name, (double)(1L << b) / 1000000, cumulative);
+    }
+    body_printf(f, "httpd2_%s_duration_seconds_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+    body_printf(f, "httpd2_%s_duration_seconds_sum %.6f\n", name, (double)h->sum_usec / 1000000);
+    body_printf(f, "httpd2_%s_duration_seconds_count %lu\n", name, h->count);
+}
+
+// status_pathへのリクエストに、全ワーカーを合わせた統計をPrometheusのテキスト形式で返す
+static void do_status_response(struct HTTPRequest *req, struct ResponseHeader *out, struct ResponseBody *body) {
+    struct BodyBuilder b = { NULL, 0, 0, 0 };
+    struct BodyBuilder *f = &b;
+    struct WorkerStats sum;
+    size_t i;
+    int k;
+
+    stats_sum(&sum);
+    body_printf(f, "# TYPE httpd2_requests_total counter\n");
+    for (k = 0; k < NUM_STAT_METHODS; k++)
+        body_printf(f, "httpd2_requests_total{method=\"%s\"} %lu\n", stat_method_names[k], sum.requests[k]);
+    body_printf(f, "# TYPE httpd2_responses_total counter\n");
+    for (i = 0; i < NUM_STAT_STATUSES - 1; i++)
+        body_printf(f, "httpd2_responses_total{code=\"%d\"} %lu\n", stat_status_codes[i], sum.responses[i]);
+    body_printf(f, "httpd2_responses_total{code=\"other\"} %lu\n", sum.responses[i]);
+    body_printf(f, "# TYPE httpd2_sent_bytes_total counter\n");
+    body_printf(f, "httpd2_sent_bytes_total %lu\n", sum.bytes_sent);
+    body_printf(f, "# TYPE httpd2_connections_total counter\n");
+    body_printf(f, "httpd2_connections_total %lu\n", sum.connections);
+    body_printf(f, "# TYPE httpd2_connections_active gauge\n");
+    body_printf(f, "httpd2_connections_active %ld\n", sum.active_connections);
+    body_printf(f, "# TYPE httpd2_file_cache_requests_total counter\n");
+    body_printf(f, "httpd2_file_cache_requests_total{result=\"hit\"} %lu\n", sum.file_cache_hits);
+    body_printf(f, "httpd2_file_cache_requests_total{result=\"miss\"} %lu\n", sum.file_cache_misses);
+    body_printf(f, "# TYPE httpd2_response_cache_requests_total counter\n");
+    body_printf(f, "httpd2_response_cache_requests_total{result=\"hit\"} %lu\n", sum.response_cache_hits);
+    body_printf(f, "httpd2_response_cache_requests_total{result=\"miss\"} %lu\n", sum.response_cache_misses);
+    body_printf(f, "# TYPE httpd2_response_cache_evictions_total counter\n");
+    body_printf(f, "httpd2_response_cache_evictions_total %lu\n", sum.response_cache_evictions);
+    body_printf(f, "# TYPE httpd2_response_cache_bytes gauge\n");
+    body_printf(f, "httpd2_response_cache_bytes %ld\n", sum.response_cache_bytes);
+    // 上限はプロセスごと (スレッドでは全体で1つ)
+    body_printf(f, "# TYPE httpd2_response_cache_limit_bytes gauge\n");
+    body_printf(f, "httpd2_response_cache_limit_bytes %zu\n", response_cache_size);
+    for (k = 0; k < NUM_LATENCIES; k++)
+        output_latency_histogram(f, latency_names[k], &sum.latency[k]);
+    body_printf(f, "# TYPE httpd2_access_log_dropped_total counter\n");
+    body_printf(f, "httpd2_access_log_dropped_total %lu\n", sum.access_log_dropped);
+    body_printf(f, "# TYPE httpd2_workers gauge\n");
+    body_printf(f, "httpd2_workers %d\n", stats_nslots);
+    body->data_buf = b.buf;
+    if (b.failed) {
+        out->failed = 1;
+        return;
+    }
+
+    output_common_header_fields(req, out, "200 OK");
+    header_printf(out, "Content-Length: %zu\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Cache-Control: no-store\r\n"
+                       "\r\n", b.len);
+    if (!slice_equals(req->method, "HEAD")) {
+        body->data = body->data_buf;
+        body->data_len = b.len;
+    }
+}
+
+static void respond_to(struct HTTPRequest *req, struct ResponseHeader *out, char *docroot, struct ResponseBody *body) {
+    if (status_path && strcmp(req->path.ptr, status_path) == 0
+        && (slice_equals(req->method, "GET") || slice_equals(req->method, "HEAD")))
+        do_status_response(req, out, body);
+    else if (slice_equals(req->method, "GET"))
+        do_file_response(req, out, docroot, body);
+    else if (slice_equals(req->method, "HEAD"))
+        do_file_response(req, out, docroot, body);
+    else if (slice_equals(req->method, "POST"))
+        output_error_page(req, out, PAGE_METHOD_NOT_ALLOWED);
+    else
+        output_error_page(req, out, PAGE_NOT_IMPLEMENTED);
+}
+
+// 送信待ちのレスポンス
+struct Response {
+    struct ResponseHeader head; // ヘッダ (エラーページならボディも)
+    struct ResponseBody body;
+    off_t sent;     // 今までに送ったバイト数
+    long started;   // 組み立て終えた時刻 (now_usec())、送るのにかかった時間を測る
+};
+
+// レスポンスを組み立てる
+// ファイルの中身はメモリに載せず、res->bodyとしてヘッダの後にsendfile(2)で送る
+static void build_response(struct Response *res, struct HTTPRequest *req, char *docroot) {
+    header_init(&res->head);
+    memset(&res->body, 0, sizeof(struct ResponseBody));
+    res->body.fd = -1;
+    res->sent = 0;
+    respond_to(req, &res->head, docroot, &res->body);
+    // 組み立て途中のものは捨て、500を返して接続を閉じる
+    // 作り直したヘッダは起動時に作ったエラーページを指すだけなので溢れない
+    if (res->head.failed) {
+        log_message(LOG_WARNING, "failed to build response for %.128s", req->path.ptr);
+        finish_response_body(&res->body);
+        header_init(&res->head);
+        req->keep_alive = 0;
+        output_error_page(req, &res->head, PAGE_INTERNAL_SERVER_ERROR);
+    }
+    res->started = now_usec();
+}
+
+// 解析できなかったリクエストにエラーページを返す、rはparse_request()かボディを読んだときの戻り値
+// 元のリクエストは使えないので代わりのリクエストをarenaに作って返す、送ったら接続を閉じる
+static struct HTTPRequest *build_error_response(struct Response *res, struct Arena *arena, int r) {
+    struct HTTPRequest *req;
+    enum ErrorPageId id;
+
+    switch (r) {
+    case PARSE_TOO_LARGE:       id = PAGE_HEADER_TOO_LARGE; break;
+    case PARSE_BODY_TOO_LARGE:  id = PAGE_PAYLOAD_TOO_LARGE; break;
+    default:                    id = PAGE_BAD_REQUEST; break;
+    }
+
+    req = arena_alloc(arena, sizeof(struct HTTPRequest));
+    memset(req, 0, sizeof(struct HTTPRequest));
+    req->method.ptr = req->path.ptr = "";
+    req->keep_alive = 0;    // 次のリクエストの区切りが分からないので使い回さない
+    header_init(&res->head);
+    memset(&res->body, 0, sizeof(struct ResponseBody));
+    res->body.fd = -1;
+    res->sent = 0;
+    output_error_page(req, &res->head, id);
+    res->started = now_usec();
+    return req;
+}
+
+static void finish_response(struct Response *res) {
+    header_init(&res->head);
+    finish_response_body(&res->body);
+}
+
+enum {
+    SEND_DONE,
+    SEND_AGAIN,     // ノンブロッキングのソケットが一杯になった
+    SEND_ERROR,
+};
+
+// レスポンスを送れるところまで送る、途中から呼び直せば続きを送る
+// ヘッダの断片とメモリ上のボディは1回のsendmsg(2)にまとめる
+// ファイルが続く場合はMSG_MOREでヘッダだけの小さなセグメントを送らないようにし、
+// sendfile(2)でページキャッシュから直接ソケットへ送る
+static int send_response(int fd, struct Response *res) {
+    struct ResponseHeader *head = &res->head;
+    struct ResponseBody *body = &res->body;
+    ssize_t n;
+    int i;
+
+  next_part:
+    for (;;) {
+        struct iovec iov[RESPONSE_IOV_MAX + 1];
+        struct msghdr msg;
+        int iovcnt = 0;
+
+        for (i = head->iov_pos; i < head->iovcnt; i++)
+            iov[iovcnt++] = head->iov[i];
+        if (body->data_len > 0) {
+            iov[iovcnt].iov_base = (char *)body->data;
+            iov[iovcnt].iov_len = body->data_len;
+            iovcnt++;
+        }
+        if (iovcnt == 0) break;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        // 相手が切断していてもSIGPIPEでプロセスごと落ちないようにMSG_NOSIGNALを付ける
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL | (body->length > 0 || body->next_part < body->nparts ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return SEND_AGAIN;
+            return SEND_ERROR;
+        }
+        res->sent += n;
+        // 送れた分だけヘッダのiovecを進め、残りがあればボディのデータを進める
+        while (n > 0 && head->iov_pos < head->iovcnt) {
+            struct iovec *v = &head->iov[head->iov_pos];
+
+            if ((size_t)n < v->iov_len) {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+                n = 0;
+                break;
+            }
+            n -= v->iov_len;
+            head->iov_pos++;
+        }
+        body->data += n;
+        body->data_len -= n;
+    }
+    while (body->length > 0) {
+        n = sendfile(fd, body->fd, &body->offset, body->length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return SEND_AGAIN;
+            return SEND_ERROR;
+        }
+        // ファイルが途中で縮んだ
+        if (n == 0) return SEND_ERROR;
+        res->sent += n;
+        body->length -= n;
+    }
+    if (next_body_part(body)) goto next_part;
+    return SEND_DONE;
+}
+
+/*
+ * アクセスログ
+ *
+ * Combined Log Formatで1リクエスト1行書く。リクエストを処理するワーカーはwrite(2)を呼ばず、
+ * ワーカーごとのリングバッファに行を入れるだけにし、バックグラウンドのライタースレッドが
+ * ACCESS_LOG_FLUSH_USECごとにまとめて書き出す。
+ * リングはワーカー1つが書き込み、ライター1つが読み出すだけなので、位置をアトミックに
+ * 読み書きするだけでロックは要らない。
+ * 書き出しが追いつかずリングが一杯になったら、ワーカーを待たせずにその行を捨てて数える。
+ * 接続ごとにforkするモデルでは子プロセスが接続を閉じるときに自分で書き出す。
+ */
+#define ACCESS_LOG_RING_SIZE (1024 * 1024)  // 2のべき乗
+#define ACCESS_LOG_LINE_MAX 2048
+#define ACCESS_LOG_FLUSH_USEC 50000
+#define CLIENT_ADDR_LEN INET6_ADDRSTRLEN
+
+struct LogRing {
+    char *buf;
+    // 位置は巻き戻さずに増やし続け、ACCESS_LOG_RING_SIZEで割った余りをバッファ内の位置にする
+    // 書き手と読み手で別のキャッシュラインに置く
+    size_t head __attribute__((aligned(64)));   // 書き込んだところ、ワーカーだけが進める
+    size_t tail __attribute__((aligned(64)));   // 書き出したところ、ライターだけが進める
+};
+
+static int access_log_fd = -1;
+static pthread_mutex_t access_log_drain_lock = PTHREAD_MUTEX_INITIALIZER;  // 読み出す側 (ライターと終了処理) だけが取る
+static struct LogRing *access_log_rings;
+static int access_log_nrings;
+static __thread struct LogRing *access_log_ring;   // 自分のリング
+
+// chroot(2)する前に呼ぶ
+static void access_log_open(void) {
+    if (!access_log_path) return;
+    access_log_fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (access_log_fd < 0)
+        log_exit("failed to open access log %s: %s", access_log_path, strerror(errno));
+    // chroot(2)の後では/etc/localtimeが読めないので、タイムゾーンを先に読んでおく
+    tzset();
+}
+
+// SIGHUPでアクセスログを開き直す (ローテーションされたファイルから新しいファイルへ移る)
+// ライタースレッドが書いている最中でも、dup3(2)でfdの指す先だけを一度に入れ替える
+static void access_log_reopen(void) {
+    int fd;
+
+    if (access_log_fd < 0) return;
+    fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_message(LOG_WARNING, "failed to reopen access log %s: %s", access_log_path, strerror(errno));
+        return;
+    }
+    if (dup3(fd, access_log_fd, O_CLOEXEC) < 0)
+        log_message(LOG_WARNING, "dup3(2) failed: %s", strerror(errno));
+    close(fd);
+}
+
+static void access_log_init(int nrings) {
+    int i;
+
+    if (access_log_fd < 0) return;
+    access_log_rings = xmalloc(sizeof(struct LogRing) * nrings);
+    memset(access_log_rings, 0, sizeof(struct LogRing) * nrings);
+    for (i = 0; i < nrings; i++)
+        access_log_rings[i].buf = xmalloc(ACCESS_LOG_RING_SIZE);
+    access_log_nrings = nrings;
+    access_log_ring = &access_log_rings[0];
+}
+
+// スレッドモードのワーカーが自分のリングを使い始める
+static void access_log_attach(int ring) {
+    if (access_log_fd < 0) return;
+    access_log_ring = &access_log_rings[ring];
+}
+
+// リングに溜まっている分を書き出す
+static void access_log_drain(struct LogRing *r) {
+    static int failing = 0;     // エラーが続いている間はログを出し続けない
+    size_t tail, head;
+
+    pthread_mutex_lock(&access_log_drain_lock);
+    tail = r->tail;
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        struct iovec iov[2];
+        size_t off = tail & (ACCESS_LOG_RING_SIZE - 1);
+        size_t len = head - tail;
+        ssize_t n;
+        int iovcnt = 1;
+
+        // バッファの終わりで折り返している場合は2つに分けて1回で書く
+        iov[0].iov_base = r->buf + off;
+        iov[0].iov_len = len < ACCESS_LOG_RING_SIZE - off ? len : ACCESS_LOG_RING_SIZE - off;
+        if (iov[0].iov_len < len) {
+            iov[1].iov_base = r->buf;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        n = writev(access_log_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // 書けなかった分は諦めて捨て、ワーカーのリングを空ける
+            if (!failing) log_message(LOG_WARNING, "failed to write access log: %s", strerror(errno));
+            failing = 1;
+            n = len;
+        } else {
+            failing = 0;
+        }
+        tail += n;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&access_log_drain_lock);
+}
+
+static void *access_log_writer(void *arg) {
+    int i;
+
+    for (;;) {
+        for (i = 0; i < access_log_nrings; i++)
+            access_log_drain(&access_log_rings[i]);
+        usleep(ACCESS_LOG_FLUSH_USEC);
+    }
+    return NULL;
+}
+
+// ライタースレッドを起動する
+// スレッドはfork(2)で引き継がれないので、ワーカーのプロセスを作ってから呼ぶ
+static void access_log_start(void) {
+    pthread_t thread;
+    sigset_t all, old;
+    int err;
+
+    if (access_log_fd < 0) return;
+    // プロセス宛てのシグナルがライターに届くと、accept(2)で待っているワーカーが起こされないので
+    // ライターでは全部のシグナルをブロックしておく (作ったスレッドはシグナルマスクを引き継ぐ)
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&thread, NULL, access_log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) log_exit("pthread_create(3) failed: %s", strerror(err));
+    pthread_detach(thread);
+}
+
+// 終了する前に残りを書き出す
+// ライタースレッドを持たない接続ごとの子プロセスも、終わる前にこれで自分で書き出す
+static void access_log_flush(void) {
+    int i;
+
+    if (access_log_fd < 0) return;
+    for (i = 0; i < access_log_nrings; i++)
+        access_log_drain(&access_log_rings[i]);
+}
+
+static void access_log_write(const char *line, size_t len) {
+    struct LogRing *r = access_log_ring;
+    size_t head = r->head;
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t off, first;
+
+    if (ACCESS_LOG_RING_SIZE - (head - tail) < len) {
+        STAT_ADD(access_log_dropped, 1);
+        return;
+    }
+    off = head & (ACCESS_LOG_RING_SIZE - 1);
+    first = len < ACCESS_LOG_RING_SIZE - off ? len : ACCESS_LOG_RING_SIZE - off;
+    memcpy(r->buf + off, line, first);
+    memcpy(r->buf, line + first, len - first);
+    // 中身を書き終えてから位置を進め、ライターが書きかけの行を読まないようにする
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+// 書き込み先の1行、入りきらない分は切り捨てる (改行の分は空けておく)
+struct LogLine {
+    char buf[ACCESS_LOG_LINE_MAX];
+    size_t len;
+};
+
+static void log_line_printf(struct LogLine *l, const char *fmt, ...) {
+    size_t room = sizeof(l->buf) - 1 - l->len;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(l->buf + l->len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    l->len += (size_t)n < room ? (size_t)n : room - 1;
+}
+
+// リクエストから来た文字列は、ログの行や引用符を壊さないよう制御文字・"・\をエスケープする
+static void log_line_escaped(struct LogLine *l, const char *str) {
+    const unsigned char *p;
+
+    if (!str) {
+        log_line_printf(l, "-");
+        return;
+    }
+    for (p = (const unsigned char *)str; *p && l->len < sizeof(l->buf) - 5; p++) {
+        if (*p == '"' || *p == '\\')
+            l->len += sprintf(l->buf + l->len, "\\%c", *p);
+        else if (*p < 0x20 || *p >= 0x7f)
+            l->len += sprintf(l->buf + l->len, "\\x%02x", *p);
+        else
+            l->buf[l->len++] = *p;
+    }
+}
+
+// 時刻の部分は1秒に1回だけ作り直す
+static __thread struct {
+    time_t t;
+    char str[32];
+} access_log_time;
+
+// Combined Log Formatの1行を書く
+// %bの代わりにヘッダも含めて実際に送ったバイト数を書く (途中で切断された場合も分かるように)
+static void access_log_request(const char *client, struct HTTPRequest *req, struct Response *res) {
+    struct LogLine line;
+    time_t now;
+    struct tm tm;
+
+    if (access_log_fd < 0) return;
+    now = time(NULL);
+    if (now != access_log_time.t) {
+        localtime_r(&now, &tm);
+        strftime(access_log_time.str, sizeof(access_log_time.str), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        access_log_time.t = now;
+    }
+    line.len = 0;
+    log_line_printf(&line, "%s - - [%s] \"", client, access_log_time.str);
+    // 解析できなかったリクエストはリクエストラインが無い
+    if (req->method.len > 0) {
+        log_line_escaped(&line, req->method.ptr);
+        log_line_printf(&line, " ");
+        log_line_escaped(&line, req->path.ptr);
+        log_line_printf(&line, " HTTP/1.%d", req->protocol_minor_version);
+    } else {
+        log_line_printf(&line, "-");
+    }
+    log_line_printf(&line, "\" %d %lld \"", res->head.status, (long long)res->sent);
+    log_line_escaped(&line, known_header_value(req, HDR_REFERER));
+    log_line_printf(&line, "\" \"");
+    log_line_escaped(&line, known_header_value(req, HDR_USER_AGENT));
+    log_line_printf(&line, "\"");
+    line.buf[line.len++] = '\n';
+    access_log_write(line.buf, line.len);
+}
+
+// アクセスログに書くクライアントのアドレス
+static void peer_address(int sock, char *buf, size_t len) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+
+    if (getpeername(sock, (struct sockaddr *)&addr, &addrlen) < 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    // Unixドメインソケットの相手にはアドレスが無い
+    if (addr.ss_family == AF_UNIX) {
+        snprintf(buf, len, UNIX_SOCKET_PREFIX);
+        return;
+    }
+    // デュアルスタックのソケットではIPv4の相手が::ffff:a.b.c.dに見えるので、IPv4のアドレスに戻して書く
+    if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            if (!inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], buf, len))
+                snprintf(buf, len, "-");
+            return;
+        }
+    }
+    if (getnameinfo((struct sockaddr *)&addr, addrlen, buf, len, NULL, 0, NI_NUMERICHOST) != 0)
+        snprintf(buf, len, "-");
+}
+
+// 送り終えた (もしくは途中で送れなくなった) レスポンスを統計とアクセスログに入れる
+static void record_response(const char *client, struct HTTPRequest *req, struct Response *res) {
+    enum StatMethod method;
+    size_t i;
+
+    if (slice_equals(req->method, "GET")) method = STAT_GET;
+    else if (slice_equals(req->method, "HEAD")) method = STAT_HEAD;
+    else if (slice_equals(req->method, "POST")) method = STAT_POST;
+    else method = STAT_OTHER_METHOD;
+    for (i = 0; i < NUM_STAT_STATUSES - 1; i++) {
+        if (stat_status_codes[i] == res->head.status) break;
+    }
+    STAT_ADD(requests[method], 1);
+    STAT_ADD(responses[i], 1);
+    STAT_ADD(bytes_sent, res->sent);
+    stats_record_latency(LAT_SEND, now_usec() - res->started);
+    access_log_request(client, req, res);
+}
+
+// エラーページを送った接続を閉じる前に、相手が送ってくる残りのデータを読み捨てる
+// 未読のデータがあるままclose(2)するとRSTが送られ、相手がエラーページを受け取る前に捨ててしまう
+// 送信側を閉じて相手に終わりを知らせ、相手が閉じるかLINGERING_TIMEOUT秒経つまで待つ
+static void discard_input(int fd) {
+    struct timeval tv = { .tv_sec = LINGERING_TIMEOUT, .tv_usec = 0 };
+    char buf[BLOCK_BUF_SIZE];
+    time_t deadline = time(NULL) + LINGERING_TIMEOUT;
+
+    if (shutdown(fd, SHUT_WR) < 0) return;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (time(NULL) < deadline && read(fd, buf, sizeof buf) > 0)
+        ;
+}
+
+// 1リクエストを処理する、接続を使い回せる場合は1を返す
+// nrequestsはこの接続で何番目のリクエストか、rbとarenaは接続ごとに使い回す
+static int service(int fd, struct RecvBuffer *rb, char *docroot, int nrequests, struct Arena *arena, const char *client) {
+    struct HTTPRequest *req;
+    struct Response res;
+    int keep_alive;
+    int r;
+
+    arena_reset(arena);
+    r = read_request(fd, rb, arena, &req, nrequests);
+    if (r < 0) return 0;
+    if (r == PARSE_OK) {
+        // 終了を待っている間は、処理中のリクエストに返したら接続を閉じる
+        req->keep_alive = wants_keep_alive(req) && nrequests < max_keepalive_requests && !draining;
+        build_response(&res, req, docroot);
+    } else {
+        req = build_error_response(&res, arena, r);
+    }
+    // 相手が先に切断した場合などは、この接続だけを閉じて次の接続を待つ
+    if (send_response(fd, &res) != SEND_DONE) {
+        log_message(LOG_INFO, "failed to send response for %s: %s", req->path.ptr, strerror(errno));
+        req->keep_alive = 0;
+    } else if (r != PARSE_OK) {
+        discard_input(fd);
+    }
+    record_response(client, req, &res);
+    finish_response(&res);
+    keep_alive = req->keep_alive;
+    recv_buffer_consume(rb);
+    check_stats_request();
+    return keep_alive;
+}
+
+void debug() {
+    struct HTTPRequest *req;
+    struct RecvBuffer rb;
+    struct Arena arena;
+    int fd;
+    fd = open("testdata/get_withbody.txt", O_RDONLY);
+    if (fd < 0) log_exit("open(2) failed: %s", strerror(errno));
+    known_headers_init();
+    stats_init(1);
+    recv_buffer_init(&rb);
+    arena_init(&arena);
+    if (read_request(fd, &rb, &arena, &req, 1) != PARSE_OK) log_exit("no valid request in testdata");
+
+    printf("read request line. method: %s, path: %s, minor_version: %d\n", req->method.ptr, req->path.ptr, req->protocol_minor_version);
+
+    struct HTTPHeaderField *h;
+    printf("read reader.\n");
+    for (h = req->header; h < req->header + req->nheaders; h++) {
+        printf("%s=%s\n", h->name.ptr, h->value.ptr);
+    }
+    printf("read reader end.\n");
+
+    printf("host: %s, accept: %s\n", known_header_value(req, HDR_HOST),
+        lookup_header_field_value(req, "Accept"));
+
+    printf("content-length: %ld\n", req->length);
+    printf("request body: %ld bytes\n", req->body.received);
+    arena_destroy(&arena);
+    recv_buffer_destroy(&rb);
+    close(fd);
+}
+
+static void setup_environment(char *docroot, char *user, char *group) {
+    struct passwd *pw;
+    struct group *gr;
+
+    if (!user || !group) {
+        fprintf(stderr, "use both of --user and --gruop\n");
+    }
+    gr = getgrnam(group);
+    if (!gr) {
+        fprintf(stderr, "no such group: %s\n", group);
+    }
+    if (setgid(gr->gr_gid) < 0) {
+        perror("setgid(2)");
+        exit(1);
+    }
+    if (initgroups(user, gr->gr_gid) < 0) {
+        perror("initgroups(2)");
+    }
+    pw = getpwnam(user);
+    if (!pw) {
+        fprintf(stderr, "no such user: %s\n", user);
+        exit(1);
+    }
+    chroot(docroot);
+    if (setuid(pw->pw_uid) < 0) {
+        perror("setuid(2)");
+        exit(1);
+    }
+}
+
+static void become_daemon() {
+    int n;
+
+    if (chdir("/") < 0) {
+        log_exit("chdir(2) failed: %s", strerror(errno));
+    }
+    freopen("/dev/null", "r", stdin);
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    n = fork();
+    if (n < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (n != 0) _exit(0); // 親プロセスは終了
+    if (setsid() < 0) log_exit("setsid(2) failed: %s", strerror(errno));
+}
+
+static void set_nonblocking(int fd) {
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+}
+
+/*
+ * listenするアドレス
+ *
+ * --listenは何回でも指定でき、全部のソケットを同じワーカーが受け付ける。
+ *   port / *:port        IPv6のワイルドカードアドレスで、IPv4の接続も受ける (デュアルスタック)
+ *   host:port            IPv4のアドレスかホスト名
+ *   [addr]:port          IPv6のアドレス、IPV6_V6ONLYを付けるので同じポートでIPv4のアドレスも指定できる
+ *   unix:/path           Unixドメインソケット、同じホストのロードバランサーからはTCPを通らずに済む
+ * --port=nは--listen=nと同じ。
+ * chroot(2)した後にソケットを作るので、Unixドメインソケットのパスはdocrootからのパスになる。
+ */
+struct ListenAddr {
+    char *spec;     // 指定されたままの文字列、ログ用
+    char *host;     // NULLならワイルドカードアドレス
+    char *port;
+    char *path;     // Unixドメインソケットのパス、NULLならTCP
+};
+
+static struct ListenAddr listen_addrs[MAX_LISTEN_ADDRS];
+static int nlisten_addrs = 0;
+
+// 1つのワーカー (プロセスかスレッド) が受け付けるlistening socket
+struct Listeners {
+    int fds[MAX_LISTEN_ADDRS];
+    int n;
+    int next;   // 次にaccept(2)を試すソケット、先頭のソケットばかり受け付けないように順番に回す
+};
+
+// --listenの値を解析して追加する、解析できなければ-1を返す
+// argvは入れ替えで新しいバイナリにそのまま渡すので書き換えずにコピーする
+static int add_listen_addr(char *spec) {
+    struct ListenAddr *la;
+    char *buf, *colon;
+
+    if (nlisten_addrs == MAX_LISTEN_ADDRS) return -1;
+    la = &listen_addrs[nlisten_addrs];
+    memset(la, 0, sizeof *la);
+    la->spec = spec;
+    if (strncmp(spec, UNIX_SOCKET_PREFIX, strlen(UNIX_SOCKET_PREFIX)) == 0) {
+        la->path = spec + strlen(UNIX_SOCKET_PREFIX);
+        if (!*la->path || strlen(la->path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) return -1;
+        nlisten_addrs++;
+        return 0;
+    }
+    buf = strdup(spec);
+    if (!buf) log_exit("failed to allocate memory");
+    colon = strrchr(buf, ':');
+    if (!colon) {
+        la->port = buf;
+    } else if (buf[0] == '[') {
+        // IPv6のアドレスは:を含むので[]で囲む
+        if (colon == buf || colon[-1] != ']') goto invalid;
+        colon[-1] = '\0';
+        la->host = buf + 1;
+        la->port = colon + 1;
+    } else {
+        *colon = '\0';
+        if (strchr(buf, ':')) goto invalid;    // []で囲んでいないIPv6のアドレス
+        if (buf[0] && strcmp(buf, "*") != 0) la->host = buf;
+        la->port = colon + 1;
+    }
+    if (!*la->port || (la->host && !*la->host)) goto invalid;
+    nlisten_addrs++;
+    return 0;
+
+invalid:
+    // host・portはbufの中を指しているので、bufと一緒に無効になる
+    free(buf);
+    la->host = la->port = NULL;
+    return -1;
+}
+
+// アドレスごとに作るソケットの数
+// スレッドモードではTCPのアドレスはスレッドごとにSO_REUSEPORTのソケットを作る
+// Unixドメインソケットは同じパスに複数bindできないので、1つを全スレッドで共有する
+static int listen_addr_sockets(struct ListenAddr *la) {
+    return thread_workers > 0 && !la->path ? thread_workers : 1;
+}
+
+// IPv6が無効にされたホストではワイルドカードアドレスをIPv4にする
+static int ipv6_available(void) {
+    int sock;
+
+    sock = socket(AF_INET6, SOCK_STREAM, 0);
+    if (sock < 0) return errno != EAFNOSUPPORT;
+    close(sock);
+    return 1;
+}
+
+// 指定されたパスのソケットが、もう誰もlistenしていない残骸なら1を返す
+// 接続できた場合だけでなく、backlogが一杯 (EAGAIN) など相手がいるかもしれない失敗も使用中とみなす
+static int unix_socket_is_stale(struct sockaddr_un *addr) {
+    int sock, err;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) log_exit("socket(2) failed: %s", strerror(errno));
+    err = connect(sock, (struct sockaddr *)addr, sizeof *addr) == 0 ? 0 : errno;
+    close(sock);
+    return err == ECONNREFUSED || err == ENOENT;
+}
+
+// Unixドメインソケットを作ってlistenする
+// パスに残っているソケットへの接続が拒否されたら、前に動いていたプロセスが残したものなので消してからbindする
+// 終了するときには消さない (バイナリの入れ替えでは新しいプロセスが同じソケットを使い続けるため)
+static int listen_unix_socket(struct ListenAddr *la) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, la->path);
+    if (lstat(la->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (!unix_socket_is_stale(&addr))
+            log_exit("failed to listen %s: address already in use", la->spec);
+        unlink(la->path);
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) log_exit("socket(2) failed: %s", strerror(errno));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof addr) < 0)
+        log_exit("failed to listen %s: %s", la->spec, strerror(errno));
+    // ロードバランサーが別のユーザーで動いていても接続できるようにする
+    // (TCPでlistenしている場合も同じホストの誰でも接続できるのと同じ)
+    if (chmod(la->path, 0666) < 0)
+        log_exit("chmod(2) failed: %s", strerror(errno));
+    if (listen(sock, listen_backlog) < 0)
+        log_exit("failed to listen %s: %s", la->spec, strerror(errno));
+    return sock;
+}
+
+// socket, bind, listenを実行してソケットを返す
+// reuseportが真ならSO_REUSEPORTを付け、同じポートに複数のソケットをbindできるようにする
+// ホスト名が複数のアドレスに解決される場合は、最初にbindできたアドレスだけでlistenする
+static int listen_socket(struct ListenAddr *la, int reuseport) {
+    struct addrinfo hints, *res, *ai;
+    int err;
+
+    if (la->path) return listen_unix_socket(la);
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    // アドレスを省略した場合はIPv6のソケット1つでIPv4の接続も受ける
+    hints.ai_family = la->host ? AF_UNSPEC : ipv6_available() ? AF_INET6 : AF_INET;
+    hints.ai_socktype = SOCK_STREAM; // TCP (コネクション型)
+    hints.ai_flags = AI_PASSIVE; // サーバー側はPASSIVEに設定
+    if ((err = getaddrinfo(la->host, la->port, &hints, &res)) != 0) {
+        log_exit("%s: %s", la->spec, gai_strerror(err));
+    }
+
+    char *err_msg = "no address";
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        int sock; 
+
+        // 1. socket(2) で ソケットを作成
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) {
+            err_msg = strerror(errno);
+            continue;
+        }
+        // TIME_WAITのソケットが残っていると、bind(2)で「Address already in use」で失敗してしまうので、失敗しないようにSO_REUSEADDRの設定を入れる
+        int optval = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1)
+            log_exit("faild to set sockopt");
+        // SO_REUSEPORTで同じポートにbindしたソケット同士には、カーネルが接続を振り分けてくれる
+        if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1)
+            log_exit("faild to set SO_REUSEPORT: %s", strerror(errno));
+        // ワイルドカードアドレスならIPv4の接続も受ける (IPv4アドレスはIPv4射影アドレスに見える)
+        // アドレスを指定した場合はIPv6だけにして、同じポートでIPv4のアドレスにもbindできるようにする
+        // システムの既定値 (net.ipv6.bindv6only) に左右されないように必ず設定する
+        if (ai->ai_family == AF_INET6) {
+            int v6only = la->host != NULL;
+
+            if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1)
+                log_exit("faild to set IPV6_V6ONLY: %s", strerror(errno));
+        }
+
+        // 2. bind(2) で 特定ポートにソケットをバインドする
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(sock);
+            err_msg = strerror(errno);
+            continue;
+        }
+
+        // 3. listen(2) で ソケットをパッシブソケットとして設定する (接続要求を受けつけれるようにする
+        // クライアント側を逆にactive socketという
+
+        // backlogはここで指定した数だけaccept(2)を呼ぶ前にconnect(2)をしたときにサーバー側がESTABLISH OR SYN_RECVになるソケットの数(カーネルが管理するキューサイズ)を指定する
+        // このサイズ以上にconnect(2)を実行するとブロックする (クライアント側がSYN_SENT状態になる)
+        // 小さすぎると接続が集中したときにSYNが捨てられるので--backlogで指定できるようにしている
+        if (listen(sock, listen_backlog) < 0) {
+            err_msg = strerror(errno);
+            close(sock);
+            continue;
+        }
+
+        freeaddrinfo(res);
+        return sock;
+    }
+
+    // not reached here  
+    log_exit("failed to listen %s: %s", la->spec, err_msg);
+
+    return -1; 
+}
+
+// fdやメモリが足りないなど、接続が閉じられれば回復するaccept(2)のエラーならログを出して1を返す
+// 待っている接続がある限りすぐにまた失敗するので、少し待ってから呼び直させる
+static int accept_error_is_transient(int err) {
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM) return 0;
+    log_message(LOG_WARNING, "accept(2) failed: %s", strerror(err));
+    usleep(ACCEPT_RETRY_DELAY_USEC);
+    return 1;
+}
+
+/*
+ * 設定の再読み込みとバイナリの入れ替え
+ *
+ * SIGHUP: mime.typesを読み直し、アクセスログを開き直す。キャッシュしているヘッダには
+ *   Content-Typeが入っていて、ファイルも入れ替えられているかもしれないので、ファイル情報と
+ *   レスポンスのキャッシュも捨てる。プリフォークではマスターが各ワーカーへ転送する。
+ * SIGUSR2: 同じ引数で新しいバイナリをexecし、listening socketのfdを環境変数で渡して引き継がせる。
+ *   新しいプロセスが受け付けを始められるようになったらパイプで知らせてもらい、古いプロセスは
+ *   SIGQUITと同じく受け付けを止めて処理中の接続を終えてから終了する。ソケット自体は
+ *   新しいプロセスと共有したままなので、入れ替えの間に届いた接続もlisten(2)のキューに残り、
+ *   connection refusedにはならない。新しいプロセスが起動できなければ古いプロセスが動き続ける。
+ *   chroot(2)した後はバイナリが見えないことが多いので、入れ替えは失敗する。
+ * SIGQUIT: 新しい接続を受け付けず、処理中のリクエストに返し終えたら接続を閉じて終了する。
+ *   keep-aliveで次のリクエストを待っているだけの接続は、イベントループならすぐに、
+ *   ブロッキングのワーカーならkeepalive_timeout秒で閉じる。
+ */
+static int *server_fds;     // listening socket、スレッドモードではスレッドの数だけある
+static int nserver_fds;
+static char **saved_argv;   // 新しいバイナリに同じ引数を渡す
+static char *exec_path;
+static pid_t upgrade_pid = 0;   // 起動した新しいバイナリ、fork(2)モデルでは接続の子プロセスと区別する
+
+extern char **environ;
+
+// 相対パスで起動された場合も、デーモンになってchdir(2)した後で見つかるように絶対パスにしておく
+// シンボリックリンクは解決しない (リンクの付け替えで配置された新しいバイナリを起動するため)
+static void save_exec_path(char **argv) {
+    char cwd[PATH_MAX];
+
+    saved_argv = argv;
+    exec_path = argv[0];
+    if (argv[0][0] == '/' || !strchr(argv[0], '/')) return;
+    if (!getcwd(cwd, sizeof cwd)) return;
+    if (asprintf(&exec_path, "%s/%s", cwd, argv[0]) < 0)
+        log_exit("failed to allocate memory");
+}
+
+// 今の環境変数に、引き継ぐfdを知らせる変数を加えたもの
+static char **upgrade_environ(char *listen_fds, char *ready_fd) {
+    char **envp;
+    size_t n, i, j;
+
+    for (n = 0; environ[n]; n++)
+        ;
+    envp = xmalloc(sizeof(char *) * (n + 3));
+    for (i = j = 0; i < n; i++) {
+        // 自分が引き継いだときの値が残っていれば除く
+        if (strncmp(environ[i], UPGRADE_LISTEN_FDS_ENV "=", strlen(UPGRADE_LISTEN_FDS_ENV "=")) == 0 ||
+            strncmp(environ[i], UPGRADE_READY_FD_ENV "=", strlen(UPGRADE_READY_FD_ENV "=")) == 0)
+            continue;
+        envp[j++] = environ[i];
+    }
+    envp[j++] = listen_fds;
+    envp[j++] = ready_fd;
+    envp[j] = NULL;
+    return envp;
+}
+
+// 新しいバイナリを起動し、受け付けを始められるようになるまで待つ
+// 起動できたら1を返すので、呼び出し側は受け付けを止めて終了に向かう
+static int upgrade_binary(void) {
+    char listen_fds[1024], ready_fd[64], **envp, c;
+    struct pollfd pfd;
+    int pipefd[2], i, n;
+    size_t len;
+    time_t deadline;
+    pid_t pid;
+
+    len = snprintf(listen_fds, sizeof listen_fds, "%s=", UPGRADE_LISTEN_FDS_ENV);
+    for (i = 0; i < nserver_fds && len < sizeof listen_fds; i++)
+        len += snprintf(listen_fds + len, sizeof listen_fds - len, "%s%d", i ? "," : "", server_fds[i]);
+    if (len >= sizeof listen_fds) {
+        log_message(LOG_ERR, "too many listening sockets to upgrade");
+        return 0;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        log_message(LOG_ERR, "pipe2(2) failed: %s", strerror(errno));
+        return 0;
+    }
+    snprintf(ready_fd, sizeof ready_fd, "%s=%d", UPGRADE_READY_FD_ENV, pipefd[1]);
+    // スレッドモードではfork(2)した子はexecするまでmalloc(3)を使えないので先に作っておく
+    envp = upgrade_environ(listen_fds, ready_fd);
+    pid = fork();
+    if (pid < 0) {
+        log_message(LOG_ERR, "fork(2) failed: %s", strerror(errno));
+        free(envp);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        // listening socketはFD_CLOEXECを付けていないのでそのまま引き継がれる
+        // パイプは書き込み側だけ引き継ぐ
+        fcntl(pipefd[1], F_SETFD, 0);
+        execvpe(exec_path, saved_argv, envp);
+        _exit(1);
+    }
+    free(envp);
+    close(pipefd[1]);
+
+    pfd.fd = pipefd[0];
+    pfd.events = POLLIN;
+    deadline = time(NULL) + UPGRADE_TIMEOUT;
+    // 新しいプロセスが起動に失敗して終了すればEOFになる
+    do {
+        n = poll(&pfd, 1, (deadline - time(NULL)) * 1000);
+    } while (n < 0 && errno == EINTR && time(NULL) < deadline);
+    if (n > 0) n = read(pipefd[0], &c, 1);
+    close(pipefd[0]);
+    if (n != 1) {
+        log_message(LOG_ERR, "new binary %s (pid %d) did not start, keep running", exec_path, pid);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 0;
+    }
+    upgrade_pid = pid;
+    log_message(LOG_INFO, "new binary started as pid %d, draining connections", pid);
+    return 1;
+}
+
+// 古いプロセスから起動された場合は、listening socketを作らずに引き継ぐ
+// 引き継いだ数を返す、引き継ぐものが無ければ0
+static int inherit_listeners(void) {
+    char *env, *p, *end;
+    struct stat st;
+    long fd;
+    int n;
+
+    env = getenv(UPGRADE_LISTEN_FDS_ENV);
+    if (!env) return 0;
+    n = 1;
+    for (p = env; *p; p++)
+        if (*p == ',') n++;
+    server_fds = xmalloc(sizeof(int) * n);
+    nserver_fds = 0;
+    for (p = env; ; p = end + 1) {
+        fd = strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0') || fd < 0 || fd > INT_MAX ||
+            fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode))
+            log_exit("invalid %s: %s", UPGRADE_LISTEN_FDS_ENV, env);
+        server_fds[nserver_fds++] = fd;
+        if (*end == '\0') break;
+    }
+    // 新しいプロセスがさらに入れ替えるときには自分の値を渡す
+    unsetenv(UPGRADE_LISTEN_FDS_ENV);
+    return nserver_fds;
+}
+
+// 受け付けを始める準備ができたことを古いプロセスに知らせる
+static void notify_upgraded(void) {
+    char *env;
+    int fd;
+
+    env = getenv(UPGRADE_READY_FD_ENV);
+    if (!env) return;
+    fd = atoi(env);
+    if (write(fd, "1", 1) != 1)
+        log_message(LOG_WARNING, "failed to notify the old process: %s", strerror(errno));
+    close(fd);
+    unsetenv(UPGRADE_READY_FD_ENV);
+}
+
+// 全部のアドレスのlistening socketを作る
+// server_fdsにはアドレスの順に、アドレスごとにlisten_addr_sockets()個ずつ並べる
+// 入れ替えで引き継ぐ場合も同じ引数なので同じ順に並んでいる
+static void open_listeners(void) {
+    int a, i;
+
+    nserver_fds = 0;
+    for (a = 0; a < nlisten_addrs; a++)
+        nserver_fds += listen_addr_sockets(&listen_addrs[a]);
+    server_fds = xmalloc(sizeof(int) * nserver_fds);
+    nserver_fds = 0;
+    for (a = 0; a < nlisten_addrs; a++) {
+        for (i = 0; i < listen_addr_sockets(&listen_addrs[a]); i++)
+            server_fds[nserver_fds++] = listen_socket(&listen_addrs[a], thread_workers > 0);
+    }
+}
+
+// worker番目のワーカーが受け付けるソケットをアドレスごとに1つずつ集める
+// 複数あればpoll(2)で待つので、他のワーカーに先を越されてもaccept(2)で止まらないようノンブロッキングにする
+static void worker_listeners(int worker, struct Listeners *ls) {
+    int a, n, base = 0;
+
+    ls->n = 0;
+    ls->next = 0;
+    for (a = 0; a < nlisten_addrs; a++) {
+        n = listen_addr_sockets(&listen_addrs[a]);
+        ls->fds[ls->n++] = server_fds[base + (n > 1 ? worker : 0)];
+        base += n;
+    }
+    if (ls->n > 1) {
+        for (a = 0; a < ls->n; a++)
+            set_nonblocking(ls->fds[a]);
+    }
+}
+
+// いずれかのlistening socketに届いた接続をaccept(2)する
+// 1つだけならそのままaccept(2)で待つ
+// 他のワーカーに先を越された場合はEAGAINで-1を返すので、呼び出し側は待ち直す
+static int accept_listeners(struct Listeners *ls, int flags) {
+    struct pollfd pfds[MAX_LISTEN_ADDRS];
+    int i, j, sock;
+
+    if (ls->n == 1) return accept4(ls->fds[0], NULL, NULL, flags);
+    for (i = 0; i < ls->n; i++) {
+        pfds[i].fd = ls->fds[i];
+        pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, ls->n, -1) < 0) return -1;
+    for (j = 0; j < ls->n; j++) {
+        i = (ls->next + j) % ls->n;
+        if (!(pfds[i].revents & POLLIN)) continue;
+        sock = accept4(ls->fds[i], NULL, NULL, flags);
+        if (sock >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ls->next = (i + 1) % ls->n;
+            return sock;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static void reload_config(void) {
+    log_message(LOG_INFO, "reloading configuration");
+    mime_types_reload();
+    access_log_reopen();
+    file_cache_flush();
+    response_cache_flush();
+}
+
+// listening socketを持っているプロセス (スレッドモードではメインスレッド) で呼ぶ
+// 入れ替えに成功したらdrainingを立てるので、呼び出し側は受け付けを止める
+static void check_control_requests(void) {
+    if (reload_requested) {
+        reload_requested = 0;
+        reload_config();
+    }
+    if (upgrade_requested) {
+        upgrade_requested = 0;
+        if (upgrade_binary()) draining = 1;
+    }
+}
+
+// ワーカーの処理の合間に呼ぶ
+// スレッドモードではメインスレッドが処理するので、ワーカーのスレッドでは統計だけ見る
+static void check_worker_requests(void) {
+    check_stats_request();
+    if (thread_workers == 0) check_control_requests();
+}
+
+// 1本の接続を処理する
+static void serve_connection(int sock, char *docroot) {
+    // 受信の時間はread_request()がリクエストの段階ごとに決める
+    // 送信はsend_timeout秒進まなければsendmsg(2)とsendfile(2)が失敗して接続を閉じる
+    struct timeval tv = { .tv_sec = send_timeout, .tv_usec = 0 };
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+        log_message(LOG_WARNING, "failed to set SO_SNDTIMEO: %s", strerror(errno));
+
+    // パイプライン化されたリクエストは受信バッファに残っているので、そのまま次のservice()で解析される
+    struct RecvBuffer rb;
+    struct Arena arena;
+    char client[CLIENT_ADDR_LEN] = "-";
+    int nrequests = 1;
+    if (access_log_fd >= 0) peer_address(sock, client, sizeof client);
+    STAT_ADD(connections, 1);
+    STAT_ADD(active_connections, 1);
+    recv_buffer_init(&rb);
+    arena_init(&arena);
+    while (service(sock, &rb, docroot, nrequests, &arena, client))
+        nrequests++;
+    arena_destroy(&arena);
+    recv_buffer_destroy(&rb);
+    close(sock);
+    STAT_ADD(active_connections, -1);
+}
+
+static pid_t *children;      // fork(2)モデルで接続を処理している子プロセス、max_connections個まで
+static int nchildren = 0;
+
+static void add_child(pid_t pid) {
+    children[nchildren++] = pid;
+}
+
+// 回収した子プロセスを外す、入れ替えで起動した新しいバイナリは入っていないので何もしない
+static void remove_child(pid_t pid) {
+    int i;
+
+    for (i = 0; i < nchildren; i++) {
+        if (children[i] == pid) {
+            children[i] = children[--nchildren];
+            return;
+        }
+    }
+}
+
+// 終わった子プロセスを回収する
+// 同時接続数がmax_connectionsに達していたら、子プロセスが終わって空きができるまで待つ
+// 待っている間の接続はlisten(2)のキューに残り、空いたら順に受け付ける
+// 待っている間にシグナルが届いたら、空いていなくても0を返して呼び出し側に処理させる
+static int reap_children(void) {
+    pid_t pid;
+    int full;
+
+    for (;;) {
+        full = nchildren >= max_connections;
+        pid = waitpid(-1, NULL, full ? 0 : WNOHANG);
+        if (pid > 0) {
+            remove_child(pid);
+            continue;
+        }
+        if (pid < 0 && errno == EINTR) return !full;
+        if (pid < 0 && errno == ECHILD) nchildren = 0;
+        return 1;
+    }
+}
+
+// 終了する前に、接続を処理している子プロセスが全部終わるのを待つ
+// 子プロセスにもSIGQUITを送り、keep-aliveで次のリクエストを待たずに今のリクエストで閉じさせる
+// 読み込みに入る直前に届いたシグナルは取りこぼすので、drain_workers()と同じく終わるまで送り直す
+static void wait_children(void) {
+    pid_t pid;
+    int i;
+
+    for (;;) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            remove_child(pid);
+        if (pid < 0 && errno == ECHILD) nchildren = 0;
+        if (nchildren == 0) break;
+        for (i = 0; i < nchildren; i++)
+            kill(children[i], SIGQUIT);
+        // 子プロセスが終わればSIGCHLDで早く起きる
+        sleep(DRAIN_SIGNAL_INTERVAL);
+    }
+}
+
+// accept(2)をループする関数
+static void server_main(struct Listeners *ls, char *docroot) {
+    // reap_children()で空くまで待つので、同時にmax_connectionsより多くはならない
+    children = xmalloc(sizeof(pid_t) * max_connections);
+    for (;;) {
+        int sock;
+        int pid, i, room;
+
+        room = reap_children();
+        // 空きを待っている間もSIGQUITやSIGHUPを処理できるよう、ここで見てから待ち直す
+        check_control_requests();
+        if (draining) break;
+        if (!room) continue;
+
+        // 事前にforkしておく場合は prefork_main() を参照
+        // これは並行モデル (concurrency model)
+        // accpetしたらすぐにforkして子プロセスがクライアントと通信する
+        stop("before accpet(2)");
+        sock = accept_listeners(ls, SOCK_CLOEXEC);
+        if (sock < 0) {
+            // 子プロセスが終わるとSIGCHLDでEINTRになるので、ループの先頭で回収する
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+            if (accept_error_is_transient(errno)) continue;
+            log_exit("accept(2) failed: %s", strerror(errno));
+        }
+        // リクエスト解析&レスポンスを返す処理は子プロセスに任せる
+        pid = fork();
+        if (pid < 0) {
+            // プロセス数の上限などでforkできなくても、この接続を諦めるだけにする
+            log_message(LOG_WARNING, "fork(2) failed: %s", strerror(errno));
+            close(sock);
+            continue;
+        }
+        if (pid == 0) { // 子プロセス
+            // 子プロセスではlistening socketは使ってないのでクローズ
+            for (i = 0; i < nserver_fds; i++)
+                close(server_fds[i]);
+
+            // forkすることで子プロセスにファイルディスクリプタがコピーされる
+            // カーネルが管理している情報を指すポインタをコピーしているとイメージすればOK
+            // 実体をコピーしているわけではない、あくまでも同じ情報を指している
+            serve_connection(sock, docroot);
+            access_log_flush();
+            // 統計のスロットは親と共有なので、消えるキャッシュの分を戻しておく
+            STAT_ADD(response_cache_bytes, -(long)response_cache.used);
+            exit(0);
+        }
+
+        add_child(pid);
 
-static void upcase(char *str) {
-    char *p;
-            // null文字ではない間
-    for (p = str; *p; p++) {
-        *p = (char)toupper((int)*p);
+        // 親プロセスでは使っていないためcloseしないといけない
+        // closeすることで参照カウントを1つ減らすことになる(fdが差すポインタを子プロセスにコピーしているような挙動になっている)
+        close(sock);
     }
+    // 子プロセスは処理中の接続を最後まで続ける
+    wait_children();
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in) {
-    char buf[LINE_BUF_SIZE];
-    char *path, *p;
+// プリフォークモデルのワーカー
+// listening socketを全ワーカーで共有し、それぞれがaccept(2)を呼んで1接続ずつ処理する
+// 接続ごとのfork(2)が無くなるのでその分のコストがかからない
+// SIGQUITを受けたら、処理中の接続を終えてから戻る
+static void worker_main(struct Listeners *ls, char *docroot) {
+    while (!draining) {
+        int sock;
 
-    if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        // error もしくは EOF(何も読めなかった場合)
-        log_exit("no request line");
+        sock = accept_listeners(ls, SOCK_CLOEXEC);
+        if (sock < 0) {
+            // クライアントが先に切断した場合や他のワーカーに先を越された場合は、ワーカーを落とさずに次を待つ
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || accept_error_is_transient(errno)) {
+                check_worker_requests();
+                continue;
+            }
+            log_exit("accept(2) failed: %s", strerror(errno));
+        }
+        serve_connection(sock, docroot);
+        check_worker_requests();
     }
-
-    // GET /path/to/file HTTP/1.1 の部分を解析
-
-    /* メソッド部分を読み込み */
-    // 最初の空白を差す文字列のポインタを返す
-    p = strchr(buf, ' ');
-    if (!p) log_exit("parse error on request line (1): %s", buf);
-    // GET<空白>/hogeの空白部分をnull文字で置き換えてからポインタを一個進めている (以後/を指す)
-    // equivalent: *p = '\0'; p++;
-    *p++ = '\0';
-    req->method = xmalloc(p - buf);
-    // null文字までコピーするのでGET\0がコピーされる
-    strcpy(req->method, buf);
-    upcase(req->method);
-
-    /* パス部分を読み込み */
-    path = p;
-    p = strchr(path, ' ');
-    if (!p) log_exit("parse error on request line (2): %s", buf);
-    *p++ = '\0';
-    req->path = xmalloc(p - path);
-    strcpy(req->path, path);
-
-    /* HTTPバージョン部分 */
-    // 大文字小文字を無視しメジャーバージョンまで一致することを確認
-    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0)
-        log_exit("parse error on request line (3): %s", buf);
-    // マイナーバージョンを取り出す
-    p += strlen("HTTP/1.");
-    req->protocol_minor_version = atoi(p);
 }
 
-static struct HTTPHeaderField *read_header_field(FILE *in) {
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
-
-    // ヘッダを1行読み込む
-    if (!fgets(buf, LINE_BUF_SIZE, in)) {
-        // TODO: 追加した、終端まで読み込んでいたら成功扱いとしたい
-        // if (feof(in)) return NULL;
-        log_exit("failed to read request header field: %s", 
-            strerror(errno));
-    }
-    // 改行文字だった場合は最後まで読んだ or ヘッダが何もなかった
-    if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0)) {
-        return NULL;
-    }
+/*
+ * epoll(7)によるイベント駆動モデル
+ *
+ * 1プロセスでノンブロッキングのソケットを多数扱う。接続ごとに状態 (何を読んでいる途中か) を持たせ、
+ * データが届くたびに読めたところまでリクエストを解析して状態を進める。
+ * 接続ごとにプロセスを作らないので、アイドル接続が大量にあってもプロセス数は増えない。
+ */
 
-    /* ヘッダ名を読み込む Connection部分 */
-    // Connection: close
-    p = strchr(buf, ':');
-    if (!p) log_exit("parse error on request header field: %s", buf);
-    *p++ = '\0';
-    h = xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = xmalloc(p - buf);
-    strcpy(h->name, buf);
+enum ConnState {
+    CONN_READ_HEADER,   // リクエストラインとヘッダ
+    CONN_READ_BODY,
+    CONN_WRITE_RESPONSE,
+    CONN_LINGER,        // エラーページを送り終え、相手が閉じるまで読み捨てている (discard_input()を参照)
+};
 
-    /* ヘッダ値を読み込む ' close'部分の'close' */
-    // Connection: close
+// conn_process()の戻り値
+enum {
+    CONN_AGAIN, // 続きのデータ (もしくは書き込み可能になるの) を待つ
+    CONN_CLOSE, // 接続を閉じる
+};
 
-    // 先頭の空白orタブ文字が連続している文字列長をstrspnは返すのでその分ポインタを進める 
-    size_t space_length = strspn(p, " \t");
-    p += space_length;
+struct Connection {
+    int fd;
+    enum ConnState state;
+    struct RecvBuffer rb;
+    struct HTTPRequest *req;
+    struct Arena arena;     // reqはここに確保する
+    struct Response res;    // 送信中のレスポンス
+    int nrequests;  // この接続で受け付けたリクエスト数
+    int failed;     // 不正なリクエストにエラーページを返している、送ったら閉じる
+    int in_header;  // 次のリクエストが届き始めている、keep-aliveで待っている間は0
+    char client[CLIENT_ADDR_LEN];   // アクセスログに書くアドレス
+    time_t deadline;    // これを過ぎたら閉じる、状態ごとのタイムアウトで決まる
+    time_t timer;       // タイマーホイールのどの秒のスロットにつながっているか
+    struct Connection *prev, *next; // 同じスロットの接続のリスト
+};
 
-    
-    // 改行文字をコピーしないように少し修正している
-    char *value = p;
-    p = strchr(value, '\n');
-    if (!p) {
-        p = strstr(value, "\r\n");
-    }
-    *p = '\0';
-    h->value = xmalloc(strlen(value) + 1);
-    // resolved: 改行文字もコピーしてしまっているが？
-    // strcpy(h->value, p);
-    strcpy(h->value, value);
+static struct Connection *conn_new(int fd) {
+    struct Connection *conn;
 
-    return h;
+    conn = xmalloc(sizeof(struct Connection));
+    memset(conn, 0, sizeof(struct Connection));
+    conn->fd = fd;
+    conn->state = CONN_READ_HEADER;
+    recv_buffer_init(&conn->rb);
+    arena_init(&conn->arena);
+    conn->res.body.fd = -1;
+    // 最初のリクエストは接続してからheader_timeout秒以内に届き終えなければならない
+    conn->in_header = 1;
+    conn->deadline = time(NULL) + header_timeout;
+    return conn;
 }
 
-static char *lookup_header_field_value(struct HTTPRequest *req, char *field_name) {
-    struct HTTPHeaderField *h;
-    for (h = req->header; h; h = h->next) {
-        // ヘッダーは大文字小文字を無視して比較する
-        if (strcasecmp(h->name, field_name) == 0) {
-            return h->value;
-        }
-    }
+static void conn_free(struct Connection *conn) {
+    // close(2)するとepollの監視対象からも自動的に外れる
+    close(conn->fd);
+    finish_response(&conn->res);
+    arena_destroy(&conn->arena);
+    recv_buffer_destroy(&conn->rb);
+    free(conn);
+}
 
-    return NULL;
+// 接続の期限を今からsec秒後にする
+// タイマーホイールへの付け替えはイベントループが後でまとめて行う (event_update_timer())
+static void conn_set_timeout(struct Connection *conn, int sec) {
+    conn->deadline = time(NULL) + sec;
 }
 
-static long content_length(struct HTTPRequest *req) {
-    char *val;
-    long len;
+// ソケットから読めるだけ受信バッファに読み込む
+// 1: データを読んだ, 0: まだ届いていない (EAGAIN), -1: EOF・エラー・バッファ上限超過
+// ボディはデータが届くたびに期限を延ばすが、ヘッダは届き始めてからheader_timeout秒で打ち切る
+// (1バイトずつ送り続けて接続に居座るクライアントを防ぐ)
+static int conn_fill(struct Connection *conn) {
+    int r;
 
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) return 0;
+    r = recv_fill(&conn->rb, conn->fd, conn->req);
+    if (r <= 0) return r;
+    if (conn->state == CONN_READ_BODY) {
+        conn_set_timeout(conn, body_timeout);
+    } else if (!conn->in_header) {
+        conn->in_header = 1;
+        conn_set_timeout(conn, header_timeout);
+    }
+    return r;
+}
 
-    len = atol(val);
-    if (len < 0) log_exit("negative Content-Length value");
+// レスポンスを送り終えたので次のリクエストを待つ状態に戻す
+static void conn_reset(struct Connection *conn) {
+    arena_reset(&conn->arena);
+    conn->req = NULL;
+    finish_response(&conn->res);
+    recv_buffer_consume(&conn->rb);
+    conn->state = CONN_READ_HEADER;
+    // パイプライン化された次のリクエストが既に届いていれば、そのヘッダの期限を数え始める
+    conn->in_header = conn->rb.len > 0;
+    conn_set_timeout(conn, conn->in_header ? header_timeout : keepalive_timeout);
+}
 
-    return len;
+// 不正なリクエストにエラーページを返す、送ったら残りのデータは読まずに閉じる
+static void conn_fail(struct Connection *conn, int r) {
+    conn->req = build_error_response(&conn->res, &conn->arena, r);
+    conn->failed = 1;
+    conn->state = CONN_WRITE_RESPONSE;
+    conn_set_timeout(conn, send_timeout);
 }
 
-static struct HTTPRequest *read_request(FILE *in) {
+// 接続の状態機械を進められるところまで進める
+static int conn_process(struct Connection *conn, char *docroot) {
     struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
+    off_t sent;
+    int r;
 
-    req = xmalloc(sizeof(struct HTTPRequest));
-    // GET /path/to/file HTTP/1.1 の部分を解析
+    for (;;) {
+        switch (conn->state) {
+        case CONN_READ_HEADER:
+            r = parse_request(&conn->rb, &conn->arena, &req);
+            if (r == PARSE_AGAIN) {
+                if ((r = conn_fill(conn)) > 0) continue;
+                return r == 0 ? CONN_AGAIN : CONN_CLOSE;
+            }
+            if (r == PARSE_OK) r = begin_request_body(req);
+            if (r != PARSE_OK) {
+                conn_fail(conn, r);
+                break;
+            }
+            if (send_continue(conn->fd, req, &conn->rb) < 0) return CONN_CLOSE;
+            conn->req = req;
+            conn->nrequests++;
+            req->keep_alive = wants_keep_alive(req) && conn->nrequests < max_keepalive_requests && !draining;
+            conn->state = CONN_READ_BODY;
+            conn_set_timeout(conn, body_timeout);
+            break;
 
-    // リクエストラインを読む
-    read_request_line(req, in);
-    
-    // 連結リストは後ろのヘッダから格納される
-    // A1\nA2\nA3\n -> A3 -> A2 -> A1 -> NULL
-    req->header = NULL;
-    while ((h = read_header_field(in))) {
-        h->next = req->header;
-        req->header = h;
-    }
-    // リクエストのエンティティボディを読む、GETの場合は存在しないので読まない
-    req->length = content_length(req);
-    if (req->length > 0) {
-        if (req->length > MAX_REQUEST_BODY_LENGTH)
-            log_exit("request body too long");
-        req->body = xmalloc(req->length);
-        if (fread(req->body, req->length, 1, in) < 1)
-            log_exit("failed to read request body: %s", strerror(errno));
-    } else {
-        req->body = NULL;
-    }
+        case CONN_READ_BODY:
+            req = conn->req;
+            r = read_request_body(req, &conn->rb);
+            if (r == PARSE_AGAIN) {
+                if ((r = conn_fill(conn)) > 0) continue;
+                return r == 0 ? CONN_AGAIN : CONN_CLOSE;
+            }
+            if (r != PARSE_OK) {
+                conn_fail(conn, r);
+                break;
+            }
+            build_response(&conn->res, req, docroot);
+            conn->state = CONN_WRITE_RESPONSE;
+            conn_set_timeout(conn, send_timeout);
+            break;
 
-    return req;
-}
+        case CONN_WRITE_RESPONSE:
+            sent = conn->res.sent;
+            r = send_response(conn->fd, &conn->res);
+            // 相手が受け取らないまま書き込みが進まなければsend_timeout秒で閉じる
+            if (conn->res.sent != sent) conn_set_timeout(conn, send_timeout);
+            if (r == SEND_AGAIN) return CONN_AGAIN;
+            record_response(conn->client, conn->req, &conn->res);
+            if (r == SEND_ERROR) return CONN_CLOSE;
+            if (conn->failed) {
+                if (shutdown(conn->fd, SHUT_WR) < 0) return CONN_CLOSE;
+                conn->state = CONN_LINGER;
+                conn_set_timeout(conn, LINGERING_TIMEOUT);
+                break;
+            }
+            if (!conn->req->keep_alive || draining) return CONN_CLOSE;
+            // 次のリクエストへ、既に届いている分があればそのまま解析を続ける
+            conn_reset(conn);
+            break;
 
-static void free_request(struct HTTPRequest *req) {
-    struct HTTPHeaderField *h, *head;
+        case CONN_LINGER: {
+            char buf[BLOCK_BUF_SIZE];
+            ssize_t n;
 
-    // ヘッダは連結リストなので
-    head = req->header;
-    while (head) { // 非NULLの間
-        h = head;
-        head = head->next;
-        // 構造体のメンバ
-        free(h->name);
-        free(h->value);
-        // 構造体自身
-        free(h);
+            while ((n = read(conn->fd, buf, sizeof buf)) > 0)
+                ;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return CONN_AGAIN;
+            return CONN_CLOSE;
+        }
+        }
     }
-    free(req->method);
-    free(req->path);
-    free(req->body);
-    free(req);
 }
 
-static char *build_fspath(char *docroot, char *urlpath) {
-    char *path;
-    //                            スラッシュ              NULL文字
-    path = xmalloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
-    sprintf(path, "%s/%s", docroot, urlpath);
+/*
+ * タイマーホイール
+ *
+ * 接続の期限 (deadline) の秒ごとにスロットを用意し、期限のスロットのリストにつないでおく。
+ * 1秒ごとに過ぎた秒のスロットだけを見ればよいので、接続が多くても全部を調べずに済む。
+ * データが届くたびに期限は延びるが、そのたびに付け替えるとリストの操作が増えるので、
+ * 延びただけなら元のスロットのまま置いておき、そのスロットの秒が来たときに付け替える。
+ * 期限が早まったときだけすぐに付け替える。
+ * TIMER_WHEEL_SIZE秒より先の期限も同じスロットを1周回って来たときに付け替えるだけで扱える。
+ */
+#define TIMER_WHEEL_SIZE 64
 
-    return path;
+struct TimerWheel {
+    struct Connection *slots[TIMER_WHEEL_SIZE];
+    time_t now;     // この秒までのスロットは処理した
+};
+
+static void timer_add(struct TimerWheel *w, struct Connection *conn) {
+    struct Connection **slot = &w->slots[conn->deadline % TIMER_WHEEL_SIZE];
+
+    conn->timer = conn->deadline;
+    conn->prev = NULL;
+    conn->next = *slot;
+    if (*slot) (*slot)->prev = conn;
+    *slot = conn;
 }
 
+static void timer_remove(struct TimerWheel *w, struct Connection *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else w->slots[conn->timer % TIMER_WHEEL_SIZE] = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+}
 
-struct FileInfo {
-    char *path;
-    long size;
-    int ok;
+// イベントループの状態、ワーカーのプロセスかスレッドごとに1つ
+struct EventLoop {
+    int epfd;
+    struct Listeners *listeners;
+    int nconns;
+    int accepting;  // listening socketをepollで監視しているか
+    int draining;   // 受け付けを止め、残りの接続が閉じるのを待っている
+    struct TimerWheel timers;
 };
 
-static void free_fileinfo(struct FileInfo *info) {
-    free(info->path);
-    free(info);
+// listening socketの監視を止めたり再開したりする
+// 同時接続数がmax_connectionsに達している間はaccept(2)せず、接続はlisten(2)のキューに残す
+// (監視したままだとレベルトリガーのepoll_wait(2)がすぐに戻り続けてしまう)
+static void event_listen(struct EventLoop *loop, int on) {
+    struct epoll_event ev;
+    int i;
+
+    if (loop->accepting == on) return;
+    for (i = 0; i < loop->listeners->n; i++) {
+        // listening socketはdata.ptrにloop->listeners->fdsの要素を指させて接続と区別する
+        // プリフォークと組み合わせた場合に全ワーカーが一斉に起こされないようEPOLLEXCLUSIVEを付ける
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loop->listeners->fds[i];
+        if (epoll_ctl(loop->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, loop->listeners->fds[i], &ev) < 0)
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+    loop->accepting = on;
 }
 
-static struct FileInfo *get_fileinfo(char *docroot, char *urlpath) {
-    struct FileInfo *info;
-    struct stat st;
+// epollのdata.ptrがlistening socketを指していればそのfdを、接続なら-1を返す
+static int event_listener_fd(struct EventLoop *loop, void *ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    uintptr_t first = (uintptr_t)loop->listeners->fds;
 
-    info = xmalloc(sizeof(struct FileInfo));
-    info->path = build_fspath(docroot, urlpath);
-    info->ok = 0;
-    if (lstat(info->path, &st) < 0) return info;
-    // regular fileか確認
-    if (!S_ISREG(st.st_mode)) return info;
-    info->ok = 1;
-    info->size = st.st_size;
-    return info;
+    if (p < first || p >= first + sizeof(int) * loop->listeners->n) return -1;
+    return *(int *)ptr;
 }
 
-static char *guess_content_type(struct FileInfo *info) {
-    return "text/plain";
+static void event_close(struct EventLoop *loop, struct Connection *conn) {
+    timer_remove(&loop->timers, conn);
+    conn_free(conn);
+    loop->nconns--;
+    STAT_ADD(active_connections, -1);
+    if (!loop->draining) event_listen(loop, 1);
 }
 
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status) {
-    time_t t;
-    struct tm *tm;
-    char buf[TIME_BUF_SIZE];
-
-    t = time(NULL);
-    tm = gmtime(&t);
-    if (!tm) log_exit("gmtime() failed: %s", strerror(errno));
-    strftime(buf, TIME_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-    fprintf(out, "Connection: close\r\n");
-}
-
-static void method_not_allowed(struct HTTPRequest *req, FILE *out) {
-    output_common_header_fields(req, out, "405 Method Not Allowed");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>405 Method Not Allowed</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not allowed</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
-}
-
-static void not_implemented(struct HTTPRequest *req, FILE *out) {
-    output_common_header_fields(req, out, "501 Not Implemented");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>501 Not Implemented</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not implemented</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
-}
-
-static void not_found(struct HTTPRequest *req, FILE *out) {
-    output_common_header_fields(req, out, "404 Not Found");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        fprintf(out, "<html>\r\n");
-        fprintf(out, "<header><title>Not Found</title><header>\r\n");
-        fprintf(out, "<body><p>File not found</p></body>\r\n");
-        fprintf(out, "</html>\r\n");
-    }
-    fflush(out);
-}
-
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot) {
-    struct FileInfo *info;
-
-    info = get_fileinfo(docroot, req->path);
-    if (!info->ok) {
-        free_fileinfo(info);
-        not_found(req, out);
-        return;
-    }
-    output_common_header_fields(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
-    // if GET or POST or etc...
-    if (strcmp(req->method, "HEAD") != 0) {
-        int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
+// 受け付けを止め、keep-aliveで次のリクエストを待っているだけの接続を閉じる
+// 処理中の接続と、受け付けたばかりでまだ最初のリクエストが届いていない接続は
+// 1リクエストに返してから閉じる (conn_process())
+static void event_drain(struct EventLoop *loop) {
+    struct Connection *conn, *next;
+    int i;
 
-        fd = open(info->path, O_RDONLY);
-
-        if (fd < 0)
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0)
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            
-            // 最後まで読んだ場合
-            if (n == 0)
-                break;
-            // 呼んだ分だけソケットに対して書き込み
-            if (fwrite(buf, 1, n, out) < n)
-                log_exit("failed to write to socket: %s", strerror(errno));
+    event_listen(loop, 0);
+    loop->draining = 1;
+    for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+        for (conn = loop->timers.slots[i]; conn; conn = next) {
+            next = conn->next;
+            if (conn->state == CONN_READ_HEADER && conn->nrequests > 0 && !conn->in_header)
+                event_close(loop, conn);
         }
-        close(fd);
     }
+}
 
-    fflush(out);
-    free_fileinfo(info);
+// conn_process()で期限が早まった接続をスロットに付け替える
+static void event_update_timer(struct EventLoop *loop, struct Connection *conn) {
+    if (conn->deadline >= conn->timer) return;
+    timer_remove(&loop->timers, conn);
+    timer_add(&loop->timers, conn);
 }
 
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot) {
-    if (strcmp(req->method, "GET") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "HEAD") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "POST") == 0)
-        method_not_allowed(req, out);
-    else
-        not_implemented(req, out);
+// 期限を過ぎた接続を閉じる、期限が延びていた接続は新しい期限のスロットへ移す
+static void event_expire(struct EventLoop *loop) {
+    struct TimerWheel *w = &loop->timers;
+    struct Connection *conn, *next;
+    time_t now = time(NULL);
+    int n;
+
+    // 時計が大きく進んでも1周分見れば全部の接続を1回ずつ見たことになる
+    for (n = 0; w->now < now && n < TIMER_WHEEL_SIZE; n++) {
+        w->now++;
+        for (conn = w->slots[w->now % TIMER_WHEEL_SIZE]; conn; conn = next) {
+            next = conn->next;
+            if (conn->deadline <= now) {
+                event_close(loop, conn);
+            } else if (conn->timer != conn->deadline) {
+                // 先頭に付け替わるので、このまま続けても同じ接続をもう一度見ることはない
+                timer_remove(w, conn);
+                timer_add(w, conn);
+            }
+        }
+    }
+    w->now = now;
 }
 
-static void service(FILE *in, FILE *out, char *docroot) {
-    struct HTTPRequest *req;
+// listening socketに届いている接続を全部accept(2)してepollに登録する
+static void event_accept(struct EventLoop *loop, int server_fd) {
+    while (loop->nconns < max_connections) {
+        struct epoll_event ev;
+        struct Connection *conn;
+        int sock;
 
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+        sock = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN: 待っている接続はもうない
+            // 他のワーカーに先を越された場合もEAGAINになる
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // fdが足りない場合などはlistening socketが読める状態のままなので、少し待ってからepollに戻る
+            if (!accept_error_is_transient(errno))
+                log_message(LOG_WARNING, "accept(2) failed: %s", strerror(errno));
+            return;
+        }
+        conn = conn_new(sock);
+        if (access_log_fd >= 0) peer_address(sock, conn->client, sizeof conn->client);
+        else strcpy(conn->client, "-");
+        // エッジトリガーなので読み書き両方を最初に登録しておけば以後epoll_ctl(2)を呼ばずに済む
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            log_message(LOG_WARNING, "epoll_ctl(2) failed: %s", strerror(errno));
+            conn_free(conn);
+            continue;
+        }
+        timer_add(&loop->timers, conn);
+        loop->nconns++;
+        STAT_ADD(connections, 1);
+        STAT_ADD(active_connections, 1);
+    }
+    event_listen(loop, 0);
 }
 
-void debug() {
-    struct HTTPRequest *req;
-    FILE *file;
-    file = fopen("testdata/get_withbody.txt", "r");
-    req = read_request(file);
+static void event_main(struct Listeners *ls, char *docroot) {
+    struct epoll_event events[MAX_EVENTS];
+    struct EventLoop loop;
+    int i;
 
-    printf("read request line. method: %s, path: %s, minor_version: %d\n", req->method, req->path, req->protocol_minor_version);
+    memset(&loop, 0, sizeof(loop));
+    loop.listeners = ls;
+    loop.timers.now = time(NULL);
+    for (i = 0; i < ls->n; i++)
+        set_nonblocking(ls->fds[i]);
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    event_listen(&loop, 1);
 
-    struct HTTPHeaderField *h;
-    printf("read reader.\n");
-    for (h = req->header; h; h = h->next) {
-        printf("%s=%s\n", h->name, h->value);
-    }
-    printf("read reader end.\n");
+    while (!loop.draining || loop.nconns > 0) {
+        int n, fd;
 
-    printf("content-length: %ld\n", req->length);
+        // 期限を過ぎた接続を閉じるために最低でも1秒に1回は起きる
+        n = epoll_wait(loop.epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            struct Connection *conn = events[i].data.ptr;
 
-    if (req->length > 0) {
-        printf("request body: %s\n", req->body);
+            if ((fd = event_listener_fd(&loop, conn)) >= 0) {
+                event_accept(&loop, fd);
+                continue;
+            }
+            if (conn_process(conn, docroot) == CONN_CLOSE)
+                event_close(&loop, conn);
+            else
+                event_update_timer(&loop, conn);
+        }
+        check_worker_requests();
+        if (draining && !loop.draining)
+            event_drain(&loop);
+        if (time(NULL) != loop.timers.now)
+            event_expire(&loop);
     }
+    close(loop.epfd);
 }
 
-static void setup_environment(char *docroot, char *user, char *group) {
-    struct passwd *pw;
-    struct group *gr;
+static volatile sig_atomic_t master_terminating = 0;
 
-    if (!user || !group) {
-        fprintf(stderr, "use both of --user and --gruop\n");
-    }
-    gr = getgrnam(group);
-    if (!gr) {
-        fprintf(stderr, "no such group: %s\n", group);
-    }
-    if (setgid(gr->gr_gid) < 0) {
-        perror("setgid(2)");
-        exit(1);
-    }
-    if (initgroups(user, gr->gr_gid) < 0) {
-        perror("initgroups(2)");
-    }
-    pw = getpwnam(user);
-    if (!pw) {
-        fprintf(stderr, "no such user: %s\n", user);
-        exit(1);
-    }
-    chroot(docroot);
-    if (setuid(pw->pw_uid) < 0) {
-        perror("setuid(2)");
-        exit(1);
-    }
+static void master_terminate_handler(int sig) {
+    master_terminating = sig;
 }
 
-static void become_daemon() {
-    int n;
+static pid_t spawn_worker(struct Listeners *ls, char *docroot, int slot) {
+    pid_t pid;
 
-    if (chdir("/") < 0) {
-        log_exit("chdir(2) failed: %s", strerror(errno));
+    pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        stats_attach(slot);
+        access_log_start();
+        // マスター用のシグナルハンドラは引き継がない
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        trap_signal(SIGUSR1, request_stats);
+        // バイナリの入れ替えはマスターが行う、SIGHUPとSIGQUITはマスターから転送される
+        signal(SIGUSR2, SIG_IGN);
+        reload_requested = upgrade_requested = 0;
+        if (event_mode)
+            event_main(ls, docroot);
+        else
+            worker_main(ls, docroot);
+        access_log_flush();
+        exit(0);
     }
-    freopen("/dev/null", "r", stdin);
-    freopen("/dev/null", "w", stdout);
-    freopen("/dev/null", "w", stderr);
-    n = fork();
-    if (n < 0) log_exit("fork(2) failed: %s", strerror(errno));
-    if (n != 0) _exit(0); // 親プロセスは終了
-    if (setsid() < 0) log_exit("setsid(2) failed: %s", strerror(errno));
+    return pid;
 }
 
-// socket, bind, listenを実行してソケットを返す
-static int listen_socket(char *port) {
-    struct addrinfo hints, *res, *ai;
-    int err;
+// 処理中の接続を終えてから終了するようワーカーに伝え、全員が終わるまで待つ
+// accept(2)に入る直前に届いたシグナルは取りこぼすので、終わるまで送り直す
+static void drain_workers(pid_t *workers, int nworkers) {
+    int i, remaining;
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET; // IPv4接続
-    hints.ai_socktype = SOCK_STREAM; // TCP (コネクション型)
-    hints.ai_flags = AI_PASSIVE; // サーバー側はPASSIVEに設定
-    if ((err = getaddrinfo(NULL, port, &hints, &res)) != 0) {
-        log_exit(gai_strerror(err));
-    }
+    do {
+        remaining = 0;
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i] <= 0) continue;
+            if (waitpid(workers[i], NULL, WNOHANG) != 0) {
+                workers[i] = 0;
+                continue;
+            }
+            kill(workers[i], SIGQUIT);
+            remaining++;
+        }
+        if (remaining) sleep(DRAIN_SIGNAL_INTERVAL);
+    } while (remaining && !master_terminating);
+}
 
-    char *err_msg = NULL;
+// マスタープロセス: ワーカーを起動したあとは wait(2) で終了を監視し、落ちたワーカーを起動し直す
+static void prefork_main(struct Listeners *ls, char *docroot, int nworkers) {
+    pid_t *workers;
+    time_t *started;
+    struct sigaction act;
+    int i;
 
-    for (ai = res; ai; ai = ai->ai_next) {
-        int sock; 
+    workers = xmalloc(sizeof(pid_t) * nworkers);
+    started = xmalloc(sizeof(time_t) * nworkers);
 
-        // 1. socket(2) で ソケットを作成
-        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (sock < 0) continue;
-        // TIME_WAITのソケットが残っていると、bind(2)で「Address already in use」で失敗してしまうので、失敗しないようにSO_REUSEADDRの設定を入れる
-        int optval = 1;
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1)
-            log_exit("faild to set sockopt");
+    // SIGTERMでwait(2)から抜けられるようにSA_RESTARTは付けない
+    act.sa_handler = master_terminate_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGTERM, &act, NULL) < 0 || sigaction(SIGINT, &act, NULL) < 0)
+        log_exit("sigaction(2) failed: %s", strerror(errno));
+    // 統計はワーカーごとに持っているのでSIGUSR1はワーカーへ転送する
+    act.sa_handler = request_stats;
+    if (sigaction(SIGUSR1, &act, NULL) < 0)
+        log_exit("sigaction(2) failed: %s", strerror(errno));
 
-        // 2. bind(2) で 特定ポートにソケットをバインドする
-        if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
-            close(sock);
-            err_msg = strerror(errno);
-            continue;
-        }
+    for (i = 0; i < nworkers; i++) {
+        workers[i] = spawn_worker(ls, docroot, i);
+        if (workers[i] < 0) log_exit("fork(2) failed: %s", strerror(errno));
+        started[i] = time(NULL);
+    }
 
-        // 3. listen(2) で ソケットをパッシブソケットとして設定する (接続要求を受けつけれるようにする
-        // クライアント側を逆にactive socketという
+    while (!master_terminating && !draining) {
+        int status;
+        pid_t pid;
 
-        // backlogはここで指定した数だけaccept(2)を呼ぶ前にconnect(2)をしたときにサーバー側がESTABLISH OR SYN_RECVになるソケットの数(カーネルが管理するキューサイズ)を指定する
-        // このサイズ以上にconnect(2)を実行するとブロックする (クライアント側がSYN_SENT状態になる)
-        if (listen(sock, MAX_BACKLOG) < 0) {
-            close(sock);
-            continue;
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR && stats_requested) {
+                stats_requested = 0;
+                for (i = 0; i < nworkers; i++) {
+                    if (workers[i] > 0) kill(workers[i], SIGUSR1);
+                }
+            }
+            // キャッシュはワーカーごとに持っているので、各ワーカーにも読み直させる
+            // マスター自身も読み直し、この後に起動し直すワーカーに引き継ぐ
+            if (errno == EINTR && reload_requested) {
+                for (i = 0; i < nworkers; i++) {
+                    if (workers[i] > 0) kill(workers[i], SIGHUP);
+                }
+            }
+            if (errno == EINTR) {
+                check_control_requests();
+                continue;
+            }
+            log_exit("wait(2) failed: %s", strerror(errno));
         }
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i] == pid) break;
+        }
+        if (i == nworkers) continue;
 
-        freeaddrinfo(res);
-        return sock;
+        if (WIFSIGNALED(status))
+            log_message(LOG_WARNING, "worker %d killed by signal %d", pid, WTERMSIG(status));
+        else
+            log_message(LOG_WARNING, "worker %d exited with status %d", pid, WEXITSTATUS(status));
+
+        // 起動直後に落ち続ける場合にfork(2)が暴走しないよう間隔をあける
+        if (time(NULL) - started[i] < WORKER_RESPAWN_INTERVAL)
+            sleep(WORKER_RESPAWN_INTERVAL);
+        workers[i] = spawn_worker(ls, docroot, i);
+        if (workers[i] < 0)
+            log_message(LOG_ERR, "fork(2) failed: %s", strerror(errno));
+        started[i] = time(NULL);
     }
 
-    // not reached here  
-    log_exit("failed to listen socket: %s", err_msg);
+    if (draining) drain_workers(workers, nworkers);
+    // マスターが止められたらワーカーも止める (終了を待っている途中で止められた場合も)
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+    // 入れ替えで起動した新しいバイナリも子プロセスなので、wait(2)で全部を待ってはいけない
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i] <= 0) continue;
+        while (waitpid(workers[i], NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    free(started);
+    free(workers);
+}
 
-    return -1; 
+/*
+ * マルチスレッドモデル
+ *
+ * スレッドごとにSO_REUSEPORTを付けたlistening socketを持たせる。
+ * カーネルが接続をソケット (=スレッド) ごとのacceptキューに振り分けるので、
+ * 1つのlistening socketをスレッド間で奪い合うことがない。
+ */
+
+struct ThreadWorker {
+    pthread_t thread;
+    int id;         // 統計のスロット
+    struct Listeners listeners;
+    int cpu;        // 割り当てるCPU番号、-1なら固定しない
+    char *docroot;
+};
+
+static void *thread_worker_main(void *arg) {
+    struct ThreadWorker *w = arg;
+
+    stats_attach(w->id);
+    access_log_attach(w->id);
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        // 固定できなくても動作には影響しないので警告だけにする
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            log_message(LOG_WARNING, "failed to pin thread to cpu %d", w->cpu);
+    }
+    if (event_mode)
+        event_main(&w->listeners, w->docroot);
+    else
+        worker_main(&w->listeners, w->docroot);
+    return NULL;
 }
 
-// accept(2)をループする関数
-static void server_main(int server_fd, char *docroot) {
-    for (;;) {
-        struct sockaddr_storage addr;
-        socklen_t addrlen = sizeof addr;
-        int sock;
-        int pid;
+// i番目のスレッドを割り当てるCPUを、このプロセスが使ってよいCPUの中から順番に選ぶ
+static int pick_cpu(cpu_set_t *allowed, int i) {
+    int ncpu, cpu;
 
-        // TODO: 事前にforkしておいてそれぞれのプロセスでacceptを呼び出せばプリフォークモデルとなる
-        // これは並行モデル (concurrency model)
-        // accpetしたらすぐにforkして子プロセスがクライアントと通信する
-        stop("before accpet(2)");
-        sock = accept(server_fd, (struct sockaddr*)&addr, &addrlen);
-        if (sock < 0) log_exit("accept(2) failed: %s", strerror(errno));
-        // リクエスト解析&レスポンスを返す処理は子プロセスに任せる
-        pid = fork();
-        if (pid < 0) exit(3);
-        if (pid == 0) { // 子プロセス
-            // 子プロセスではlistening socketは使ってないのでクローズ
-            close(server_fd);
+    ncpu = CPU_COUNT(allowed);
+    if (ncpu == 0) return -1;
+    i %= ncpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, allowed)) continue;
+        if (i-- == 0) return cpu;
+    }
+    return -1;
+}
 
-            // 読み込み書き込み両方とも同じソケットを使う (accept(2)でもらったソケット)
-            // forkすることで子プロセスにファイルディスクリプタがコピーされる
-            // カーネルが管理している情報を指すポインタをコピーしているとイメージすればOK
-            // 実体をコピーしているわけではない、あくまでも同じ情報を指している
-            FILE *inf = fdopen(sock, "r");
-            FILE *outf = fdopen(sock, "w");
+// メインスレッドはSIGHUP・SIGUSR2・SIGQUITを待ち、終了するときはワーカーが全部終わるまで待つ
+static void threads_main(int nthreads, char *docroot) {
+    struct ThreadWorker *workers;
+    cpu_set_t allowed;
+    sigset_t control, old;
+    int i, err;
 
-            service(inf, outf, docroot);
-            exit(0);
-        }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        CPU_ZERO(&allowed);
 
-        // 親プロセスでは使っていないためcloseしないといけない
-        // closeすることで参照カウントを1つ減らすことになる(fdが差すポインタを子プロセスにコピーしているような挙動になっている)
-        close(sock);
+    workers = xmalloc(sizeof(struct ThreadWorker) * nthreads);
+    access_log_start();
+    // SIGHUPとSIGUSR2はメインスレッドだけが受け取るよう、ワーカーではブロックする
+    // SIGQUITは待っているaccept(2)から抜けられるよう、ワーカーでも受け取る
+    sigemptyset(&control);
+    sigaddset(&control, SIGHUP);
+    sigaddset(&control, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &control, &old);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        worker_listeners(i, &workers[i].listeners);
+        workers[i].cpu = pick_cpu(&allowed, i);
+        workers[i].docroot = docroot;
+        err = pthread_create(&workers[i].thread, NULL, thread_worker_main, &workers[i]);
+        if (err != 0) log_exit("pthread_create(3) failed: %s", strerror(err));
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    // シグナルが届けばsleep(3)から抜ける
+    while (!draining) {
+        sleep(1);
+        check_control_requests();
     }
+    // 他のスレッドに届いたシグナルではaccept(2)で待っているワーカーは起きないので、
+    // 終わるまで各ワーカーへ送り直す
+    for (i = 0; i < nthreads; i++) {
+        while (pthread_tryjoin_np(workers[i].thread, NULL) == EBUSY) {
+            pthread_kill(workers[i].thread, SIGQUIT);
+            sleep(DRAIN_SIGNAL_INTERVAL);
+        }
+    }
+    access_log_flush();
+    free(workers);
 }
 
 static struct option longopts[] = {
     {"debug", no_argument, &debug_mode, 1},
+    {"event", no_argument, &event_mode, 1},
     {"chroot", no_argument, NULL, 'c'},
     {"user", required_argument, NULL, 'u'},
     {"group", required_argument, NULL, 'g'},
     {"port", required_argument, NULL, 'p'},
+    {"listen", required_argument, NULL, 'L'},
+    {"prefork", required_argument, NULL, 'f'},
+    {"threads", required_argument, NULL, 't'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"keepalive-timeout", required_argument, NULL, 'k'},
+    {"max-keepalive-requests", required_argument, NULL, 'm'},
+    {"header-timeout", required_argument, NULL, 'H'},
+    {"body-timeout", required_argument, NULL, 'I'},
+    {"send-timeout", required_argument, NULL, 'W'},
+    {"max-connections", required_argument, NULL, 'N'},
+    {"file-cache", required_argument, NULL, 'C'},
+    {"file-cache-ttl", required_argument, NULL, 'T'},
+    {"response-cache", required_argument, NULL, 'R'},
+    {"response-cache-max-object", required_argument, NULL, 'O'},
+    {"precompressed", no_argument, &precompressed, 1},
+    {"gzip", no_argument, &gzip_on_the_fly, 1},
+    {"mime-types", required_argument, NULL, 'M'},
+    {"max-request-body", required_argument, NULL, 'B'},
+    {"status-path", required_argument, NULL, 'S'},
+    {"access-log", required_argument, NULL, 'A'},
     {"help", no_argument, NULL, 'h'},
     {0, 0, 0, 0}
 };
 
 int main(int argc, char *argv[]) {
-    int server_fd;
-    char *port = NULL;
+    struct Listeners listeners;
+    int nlisteners;
+    int upgraded;
+    int i;
     char *docroot;
     int do_chroot = 0;
     char *user = NULL;
     char *group = NULL;
     int opt;
     
+    save_exec_path(argv);
     while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
         switch (opt) {
         case 0:
@@ -637,7 +4684,128 @@ int main(int argc, char *argv[]) {
             group = optarg;
             break;
         case 'p':
-            port = optarg;
+        case 'L':
+            if (add_listen_addr(optarg) < 0) {
+                fprintf(stderr, "invalid --%s value: %s\n", opt == 'p' ? "port" : "listen", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            prefork_workers = atoi(optarg);
+            if (prefork_workers <= 0) {
+                fprintf(stderr, "invalid --prefork value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            thread_workers = atoi(optarg);
+            if (thread_workers <= 0) {
+                fprintf(stderr, "invalid --threads value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            if (listen_backlog <= 0) {
+                fprintf(stderr, "invalid --backlog value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            keepalive_timeout = atoi(optarg);
+            if (keepalive_timeout <= 0) {
+                fprintf(stderr, "invalid --keepalive-timeout value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'H':
+            header_timeout = atoi(optarg);
+            if (header_timeout <= 0) {
+                fprintf(stderr, "invalid --header-timeout value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'I':
+            body_timeout = atoi(optarg);
+            if (body_timeout <= 0) {
+                fprintf(stderr, "invalid --body-timeout value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'W':
+            send_timeout = atoi(optarg);
+            if (send_timeout <= 0) {
+                fprintf(stderr, "invalid --send-timeout value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N':
+            max_connections = atoi(optarg);
+            if (max_connections <= 0) {
+                fprintf(stderr, "invalid --max-connections value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            // 1を指定するとkeep-aliveしない
+            max_keepalive_requests = atoi(optarg);
+            if (max_keepalive_requests <= 0) {
+                fprintf(stderr, "invalid --max-keepalive-requests value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'C':
+            // 0を指定するとキャッシュしない
+            file_cache_entries = atoi(optarg);
+            if (file_cache_entries < 0) {
+                fprintf(stderr, "invalid --file-cache value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'T':
+            file_cache_ttl = atoi(optarg);
+            if (file_cache_ttl < 0) {
+                fprintf(stderr, "invalid --file-cache-ttl value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'R': {
+            char *end;
+            long n;
+
+            // 0を指定するとキャッシュしない
+            errno = 0;
+            n = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno == ERANGE || n < 0) {
+                fprintf(stderr, "invalid --response-cache value: %s\n", optarg);
+                exit(1);
+            }
+            response_cache_size = n;
+            break;
+        }
+        case 'O':
+            response_cache_max_object = atol(optarg);
+            if (response_cache_max_object < 0) {
+                fprintf(stderr, "invalid --response-cache-max-object value: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'M':
+            mime_types_path = optarg;
+            break;
+        case 'S':
+            status_path = optarg;
+            break;
+        case 'A':
+            access_log_path = optarg;
+            break;
+        case 'B':
+            // ボディは受信しながら捨てるので大きくしてもメモリは増えない
+            max_request_body = atol(optarg);
+            if (max_request_body < 0) {
+                fprintf(stderr, "invalid --max-request-body value: %s\n", optarg);
+                exit(1);
+            }
             break;
         case 'h':
             fprintf(stdout, USAGE, argv[0]);
@@ -647,12 +4815,22 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
     }
-    if (optind != argc - 1) {
+    if (optind != argc - 1 || (prefork_workers > 0 && thread_workers > 0) || nlisten_addrs == 0) {
         fprintf(stderr, USAGE, argv[0]);
         exit(1);
     } 
+#ifndef USE_ZLIB
+    if (gzip_on_the_fly) {
+        fprintf(stderr, "--gzip is not available: built without USE_ZLIB\n");
+        exit(1);
+    }
+#endif
     docroot = argv[optind];
 
+    // chroot(2)すると/etc/mime.typesが見えなくなるので先に読んでおく
+    mime_types_init();
+    access_log_open();
+
     // chroot(2)を使ってdocrootをルートとする
     if (do_chroot) {
         setup_environment(docroot, user, group);
@@ -660,14 +4838,50 @@ int main(int argc, char *argv[]) {
     }
 
     install_signal_handlers();
-    server_fd = listen_socket(port);
+    known_headers_init();
+    error_pages_init();
+    response_cache_init();
+    stats_init(thread_workers > 0 ? thread_workers : prefork_workers > 0 ? prefork_workers : 1);
+    // プリフォークのワーカーはforkした時点のリングをそれぞれ自分のものとして使う
+    access_log_init(thread_workers > 0 ? thread_workers : 1);
+    // スレッドモードではTCPのアドレスごとにスレッドの数だけSO_REUSEPORTのソケットを作る
+    nlisteners = 0;
+    for (i = 0; i < nlisten_addrs; i++)
+        nlisteners += listen_addr_sockets(&listen_addrs[i]);
+    // キャッシュのfdは同じプロセスの接続とlistening socketの残りに収める
+    // イベントループはループごとにmax_connections、ブロッキングのワーカーは1接続ずつ
+    // 接続ごとにforkするモードではキャッシュを使うのは1接続だけを処理する子プロセス
+    file_cache_init(nlisteners + (thread_workers > 0 ? thread_workers : 1) * (event_mode ? max_connections : 1));
+    upgraded = inherit_listeners() > 0;
+    if (upgraded) {
+        if (nserver_fds != nlisteners)
+            log_exit("inherited %d listening sockets but %d are needed", nserver_fds, nlisteners);
+    } else {
+        open_listeners();
+    }
+    // スレッドモード以外では全部のソケットを全ワーカーで共有する (スレッドモードはthreads_main()で集める)
+    worker_listeners(0, &listeners);
 
     if (!debug_mode) {
         openlog(SERVER_NAME, LOG_PID|LOG_NDELAY, LOG_DAEMON);
-        become_daemon();
+        // 入れ替えで起動された場合は既にデーモンの子なので、古いプロセスのセッションから離れるだけでよい
+        if (upgraded) setsid();
+        else become_daemon();
     }
+    notify_upgraded();
 
-    server_main(server_fd, docroot);
+    // スレッドはfork(2)で引き継がれないのでデーモンになってから作る
+    if (thread_workers > 0)
+        threads_main(thread_workers, docroot);
+    else if (prefork_workers > 0)
+        prefork_main(&listeners, docroot, prefork_workers);
+    else if (event_mode) {
+        access_log_start();
+        event_main(&listeners, docroot);
+        access_log_flush();
+    } else {
+        server_main(&listeners, docroot);
+    }
     exit(0);
 }
 